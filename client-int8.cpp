@@ -16,6 +16,33 @@
 #include <string>
 #include <cstdint>        // For int8_t and int32_t
 #include <algorithm>      // For std::min
+#include <atomic>
+#include <climits>        // For INT_MAX
+#include <immintrin.h>    // For _mm_pause
+#include <linux/futex.h>  // For FUTEX_WAIT_PRIVATE / FUTEX_WAKE_PRIVATE
+#include <sys/mman.h>     // For shm_open / mmap
+#include <sys/un.h>       // For the metrics socket
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <mutex>
+#include <unordered_map>
+#include <deque>
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && __has_include(<coroutine>)
+#include <coroutine>      // The coroutine executor (--coro) needs -std=c++20.
+#define HAVE_COROUTINES 1
+#else
+#define HAVE_COROUTINES 0
+#endif
+#include <vector>
+#include <dirent.h>       // For /proc/irq
+#include <fcntl.h>        // For open
+#include <csignal>        // For restoring IRQs on SIGINT/SIGTERM
+#include <cmath>
+#include <linux/perf_event.h>
+#include <sys/uio.h>      // For writev
+#include <netinet/udp.h>  // For UDP_SEGMENT
+#include "wire_format.h"   // Mux header shared with the server
 
 // Matrix dimensions.
 #define ROWS 128
@@ -25,40 +52,3020 @@
 // Define the size of the message to send (1KB).
 #define ONE_KB 2560
 
+// Returns the value of an optional "--key=value" flag, or def if it is absent.
+const char* get_opt(int argc, char* argv[], const char* key, const char* def) {
+    size_t key_len = strlen(key);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0 && strncmp(argv[i] + 2, key, key_len) == 0 &&
+            argv[i][2 + key_len] == '=') {
+            return argv[i] + 3 + key_len;
+        }
+    }
+    return def;
+}
+
+// Returns the p-th percentile (0-100) of the samples.
+double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0.0;
+    std::sort(samples.begin(), samples.end());
+    size_t idx = (size_t)(p / 100.0 * (samples.size() - 1) + 0.5);
+    return samples[std::min(idx, samples.size() - 1)];
+}
+
+// CPU time consumed by the calling thread, in seconds.
+double thread_cpu_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Real-time scheduling and core isolation (--rt=fifo|deadline, --irq_move=1). Every step is
+// best effort; what actually took effect is counted and printed by print_rt_report.
+enum RtPolicy {
+    RT_NONE,
+    RT_FIFO,
+    RT_DEADLINE
+};
+
+enum RtRole {
+    RT_COMPUTE,
+    RT_SEND,
+    NUM_RT_ROLES
+};
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+
+// struct sched_attr of sched_setattr(2), which glibc does not wrap.
+struct SchedAttr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+struct RtConfig {
+    int policy;
+    int prio[NUM_RT_ROLES];         // SCHED_FIFO priority per role.
+    uint64_t dl_runtime_ns;         // SCHED_DEADLINE reservation of each compute thread.
+    uint64_t dl_period_ns;
+    std::atomic<int> applied[NUM_RT_ROLES];
+    std::atomic<int> failed[NUM_RT_ROLES];
+    std::atomic<int> last_errno[NUM_RT_ROLES];
+};
+
+// Set once in main before any compute or send thread starts.
+RtConfig rt_config;
+
+// Puts the calling thread under the configured policy. Under --rt=deadline only the compute
+// threads get a SCHED_DEADLINE reservation; send threads are sporadic and use SCHED_FIFO.
+void rt_apply(int role) {
+    RtConfig& rc = rt_config;
+    if (rc.policy == RT_NONE) return;
+    int err = 0;
+    if (rc.policy == RT_DEADLINE && role == RT_COMPUTE) {
+        SchedAttr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.sched_policy = SCHED_DEADLINE;
+        attr.sched_runtime = rc.dl_runtime_ns;
+        attr.sched_deadline = rc.dl_period_ns;
+        attr.sched_period = rc.dl_period_ns;
+        // A SCHED_DEADLINE thread may not clone; with this flag the send threads it creates start
+        // under SCHED_OTHER and then take their own policy.
+        attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+        if (syscall(SYS_sched_setattr, 0, &attr, 0) != 0) err = errno;
+    } else {
+        sched_param sp;
+        sp.sched_priority = rc.prio[role];
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    }
+    if (err) {
+        rc.failed[role]++;
+        rc.last_errno[role].store(err);
+    } else {
+        rc.applied[role]++;
+    }
+}
+
+// "0-3,8" -> {0, 1, 2, 3, 8}.
+std::vector<int> parse_core_list(const std::string& list) {
+    std::vector<int> cores;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t dash = item.find('-');
+        if (!item.empty()) {
+            int first = atoi(item.c_str());
+            int last = dash == std::string::npos ? first : atoi(item.c_str() + dash + 1);
+            for (int c = first; c <= last; c++) {
+                cores.push_back(c);
+            }
+        }
+        if (comma == std::string::npos) break;
+        pos = comma + 1;
+    }
+    return cores;
+}
+
+// First line of a procfs/sysfs file without the newline; empty if it cannot be read.
+std::string read_first_line(const char* path) {
+    char line[4096] = "";
+    FILE* f = fopen(path, "r");
+    if (!f) return "";
+    if (!fgets(line, sizeof(line), f)) line[0] = '\0';
+    fclose(f);
+    std::string s(line);
+    while (!s.empty() && (s.back() == '\n' || s.back() == ' ')) s.pop_back();
+    return s;
+}
+
+// Core list of a sysfs file such as /sys/devices/system/cpu/isolated ("(null)" when unset).
+std::vector<int> read_core_list(const char* path) {
+    std::string s = read_first_line(path);
+    if (s.empty() || s[0] == '(') return std::vector<int>();
+    return parse_core_list(s);
+}
+
+// Core list of a kernel command line parameter such as rcu_nocbs=4-7.
+std::vector<int> cmdline_core_list(const char* param) {
+    std::string cmdline = " " + read_first_line("/proc/cmdline");
+    size_t pos = cmdline.find(" " + std::string(param) + "=");
+    if (pos == std::string::npos) return std::vector<int>();
+    pos += strlen(param) + 2;
+    std::string value = cmdline.substr(pos, cmdline.find(' ', pos) - pos);
+    if (value == "all") {
+        std::vector<int> all;
+        for (int c = 0; c < sysconf(_SC_NPROCESSORS_CONF); c++) all.push_back(c);
+        return all;
+    }
+    return parse_core_list(value);
+}
+
+struct IrqMove {
+    int irq;
+    std::string original;   // smp_affinity_list before the move, restored at exit.
+    std::string path;       // Its /proc/irq/<n>/smp_affinity_list.
+};
+
+// The IRQs moved for this run while they are moved, for the SIGINT/SIGTERM handler.
+std::atomic<const std::vector<IrqMove>*> irq_signal_moves{nullptr};
+
+// Points every IRQ whose affinity includes a compute core at the other online cores. Per-CPU
+// and kernel-managed IRQs refuse the write (EIO), and without root every write fails.
+void move_irqs_off(const std::vector<int>& compute, int num_cores, std::vector<IrqMove>& moved, int* refused,
+                   int* untouched) {
+    std::string allowed;
+    for (int c = 0; c < num_cores; c++) {
+        if (std::find(compute.begin(), compute.end(), c) != compute.end()) continue;
+        allowed += (allowed.empty() ? "" : ",") + std::to_string(c);
+    }
+    *refused = 0;
+    *untouched = 0;
+    if (allowed.empty()) return;
+    DIR* dir = opendir("/proc/irq");
+    if (!dir) return;
+    while (dirent* e = readdir(dir)) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+        std::string path = std::string("/proc/irq/") + e->d_name + "/smp_affinity_list";
+        std::string original = read_first_line(path.c_str());
+        bool overlaps = false;
+        for (int c : parse_core_list(original)) {
+            overlaps = overlaps || std::find(compute.begin(), compute.end(), c) != compute.end();
+        }
+        if (!overlaps) {
+            (*untouched)++;
+            continue;
+        }
+        FILE* f = fopen(path.c_str(), "w");
+        bool ok = f && fputs(allowed.c_str(), f) >= 0;
+        // The kernel validates the mask on write-back, so the error shows up at fclose.
+        if (f && fclose(f) != 0) ok = false;
+        if (ok) {
+            moved.push_back({std::atoi(e->d_name), original, path});
+        } else {
+            (*refused)++;
+        }
+    }
+    closedir(dir);
+}
+
+void restore_irqs(const std::vector<IrqMove>& moved) {
+    irq_signal_moves.store(nullptr);   // Nothing left for the signal handler to restore.
+    for (const IrqMove& m : moved) {
+        FILE* f = fopen(m.path.c_str(), "w");
+        if (!f) continue;
+        fputs(m.original.c_str(), f);
+        fclose(f);
+    }
+}
+
+// SIGINT/SIGTERM during a run with --irq_move: puts the moved IRQs back (with
+// async-signal-safe calls only), then dies of the signal as it would have without the handler.
+void restore_irqs_on_signal(int sig) {
+    if (const std::vector<IrqMove>* moved = irq_signal_moves.exchange(nullptr)) {
+        for (const IrqMove& m : *moved) {
+            int fd = open(m.path.c_str(), O_WRONLY);
+            if (fd < 0) continue;
+            if (write(fd, m.original.data(), m.original.size()) < 0) {
+                // Nothing more can be done from a signal handler.
+            }
+            close(fd);
+        }
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Puts the moved IRQs back when main returns early (e.g. after a failed connect); the normal
+// end of the run restores them itself and sets done.
+struct IrqRestore {
+    const std::vector<IrqMove>& moved;
+    bool done = false;
+    ~IrqRestore() {
+        if (!done) restore_irqs(moved);
+    }
+};
+
+// Which protections took effect: scheduling policy per role, isolation of every compute core
+// (isolcpus, nohz_full, rcu_nocbs), IRQ moves and the RT throttling limit.
+void print_rt_report(const std::vector<int>& compute, const std::vector<int>& send, bool irq_move, int irq_moved,
+                     int irq_refused, int irq_untouched) {
+    const RtConfig& rc = rt_config;
+    const char* policy = rc.policy == RT_FIFO ? "SCHED_FIFO" : rc.policy == RT_DEADLINE ? "SCHED_DEADLINE" : "none";
+    printf("Real-time / isolation report:\n");
+    printf("  policy %s", policy);
+    if (rc.policy == RT_DEADLINE) {
+        printf(" (compute %.0f/%.0f us runtime/period, send SCHED_FIFO %d)", rc.dl_runtime_ns / 1e3,
+               rc.dl_period_ns / 1e3, rc.prio[RT_SEND]);
+    } else if (rc.policy == RT_FIFO) {
+        printf(" (compute prio %d, send prio %d)", rc.prio[RT_COMPUTE], rc.prio[RT_SEND]);
+    }
+    printf("\n");
+    const char* role_names[NUM_RT_ROLES] = {"compute", "send"};
+    for (int r = 0; r < NUM_RT_ROLES && rc.policy != RT_NONE; r++) {
+        int applied = rc.applied[r].load(), failed = rc.failed[r].load();
+        if (applied + failed == 0) continue;
+        printf("  %-7s threads: %d applied, %d failed%s%s\n", role_names[r], applied, failed,
+               failed ? ": " : "", failed ? strerror(rc.last_errno[r].load()) : "");
+    }
+    if (rc.policy == RT_DEADLINE && rc.failed[RT_COMPUTE].load()) {
+        printf("  (SCHED_DEADLINE: EBUSY = reservations exceed the CPU bandwidth, EPERM = thread pinned to a subset\n"
+               "   of its root domain; use an exclusive cpuset for the compute cores)\n");
+    }
+
+    std::vector<int> isolated = read_core_list("/sys/devices/system/cpu/isolated");
+    std::vector<int> nohz = read_core_list("/sys/devices/system/cpu/nohz_full");
+    std::vector<int> nocbs = cmdline_core_list("rcu_nocbs");
+    auto has = [](const std::vector<int>& v, int c) { return std::find(v.begin(), v.end(), c) != v.end(); };
+    int unprotected = 0;
+    for (int c : compute) {
+        bool iso = has(isolated, c), hz = has(nohz, c), cb = has(nocbs, c);
+        printf("  compute core %d: isolcpus %s, nohz_full %s, rcu_nocbs %s\n", c, iso ? "yes" : "no",
+               hz ? "yes" : "no", cb ? "yes" : "no");
+        if (!iso) unprotected++;
+    }
+    for (int c : send) {
+        if (has(isolated, c)) {
+            printf("  send core %d is isolated: the send threads lose load balancing there\n", c);
+        }
+    }
+    if (unprotected) {
+        printf("  %d compute core(s) are not in isolcpus; other tasks may still be scheduled there\n", unprotected);
+    }
+    if (irq_move) {
+        printf("  IRQs: %d moved off the compute cores, %d refused, %d already elsewhere (restored at exit)\n",
+               irq_moved, irq_refused, irq_untouched);
+    }
+    std::string rt_runtime = read_first_line("/proc/sys/kernel/sched_rt_runtime_us");
+    if (rc.policy != RT_NONE && !rt_runtime.empty() && rt_runtime != "-1") {
+        printf("  sched_rt_runtime_us = %s: RT threads are throttled after %s us of every second\n",
+               rt_runtime.c_str(), rt_runtime.c_str());
+    }
+}
+
+// Live metrics (--metrics=<unix socket path>): per-thread counters in a shared-memory segment
+// that the compute and send paths bump with relaxed atomic adds, so no locks are taken on the
+// hot paths. An exporter thread serves the segment over a Unix domain socket in Prometheus
+// text format; the segment itself is /dev/shm/send_overhead.<pid> for tools that map it.
+#define METRIC_BUCKETS 16           // Bucket b counts values <= 2^b us; the last one is +Inf.
+#define METRIC_SLOTS 8              // Compute threads first, then the mux sender.
+#define METRICS_MAGIC 0x4d54454du   // "METM"
+
+struct alignas(64) MetricSlot {
+    char label[16];                                     // The "thread" label.
+    std::atomic<uint64_t> iterations;
+    std::atomic<uint64_t> messages;                     // Sends completed.
+    std::atomic<uint64_t> bytes;                        // Bytes of the completed sends.
+    std::atomic<uint64_t> send_errors;                  // Sends that failed (not counted above).
+    std::atomic<uint64_t> send_ns;                      // Sum of the send latencies.
+    std::atomic<uint64_t> send_buckets[METRIC_BUCKETS];
+    std::atomic<uint64_t> matmul_ns;                    // Sum of the per-iteration matmul times.
+    std::atomic<uint64_t> matmul_buckets[METRIC_BUCKETS];
+};
+
+struct MetricsSegment {
+    uint32_t magic;     // METRICS_MAGIC.
+    uint32_t slots;     // Slots in use.
+    uint32_t buckets;   // METRIC_BUCKETS.
+    uint32_t pid;
+    MetricSlot slot[METRIC_SLOTS];
+};
+
+// Adds one observation (in us) to a log2 histogram and its sum.
+void metric_observe(std::atomic<uint64_t>* buckets, std::atomic<uint64_t>* sum_ns, double us) {
+    int b = 0;
+    while (b < METRIC_BUCKETS - 1 && us > (double)(1u << b)) b++;
+    buckets[b].fetch_add(1, std::memory_order_relaxed);
+    sum_ns->fetch_add((uint64_t)(std::max(us, 0.0) * 1000.0), std::memory_order_relaxed);
+}
+
+void metric_iteration(MetricSlot* s, double matmul_us) {
+    s->iterations.fetch_add(1, std::memory_order_relaxed);
+    metric_observe(s->matmul_buckets, &s->matmul_ns, matmul_us);
+}
+
+struct MetricsExporter {
+    MetricsSegment* seg;
+    char shm_name[64];
+    std::string path;
+    int listen_fd;
+    int core_id;
+    std::atomic<bool> stopping;
+    unsigned long scrapes;
+    pthread_t thread;
+};
+
+void metric_histogram(std::string& out, const char* name, const char* help, const MetricsSegment* seg,
+                      bool send) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    out += line;
+    for (uint32_t t = 0; t < seg->slots; t++) {
+        const MetricSlot& s = seg->slot[t];
+        const std::atomic<uint64_t>* buckets = send ? s.send_buckets : s.matmul_buckets;
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            cumulative += buckets[b].load(std::memory_order_relaxed);
+            if (b < METRIC_BUCKETS - 1) {
+                snprintf(line, sizeof(line), "%s_bucket{thread=\"%s\",le=\"%g\"} %lu\n", name, s.label,
+                         (double)(1u << b) * 1e-6, (unsigned long)cumulative);
+            } else {
+                snprintf(line, sizeof(line), "%s_bucket{thread=\"%s\",le=\"+Inf\"} %lu\n", name, s.label,
+                         (unsigned long)cumulative);
+            }
+            out += line;
+        }
+        uint64_t sum_ns = (send ? s.send_ns : s.matmul_ns).load(std::memory_order_relaxed);
+        snprintf(line, sizeof(line), "%s_sum{thread=\"%s\"} %.9f\n%s_count{thread=\"%s\"} %lu\n", name, s.label,
+                 sum_ns * 1e-9, name, s.label, (unsigned long)cumulative);
+        out += line;
+    }
+}
+
+void metric_counter(std::string& out, const char* name, const char* help, const MetricsSegment* seg,
+                    std::atomic<uint64_t> MetricSlot::*field) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    out += line;
+    for (uint32_t t = 0; t < seg->slots; t++) {
+        snprintf(line, sizeof(line), "%s{thread=\"%s\"} %lu\n", name, seg->slot[t].label,
+                 (unsigned long)(seg->slot[t].*field).load(std::memory_order_relaxed));
+        out += line;
+    }
+}
+
+// One scrape in Prometheus text exposition format.
+std::string metrics_text(const MetricsSegment* seg) {
+    std::string out;
+    metric_counter(out, "send_overhead_iterations_total", "Matmul iterations finished.", seg, &MetricSlot::iterations);
+    metric_counter(out, "send_overhead_messages_total", "Sends completed.", seg, &MetricSlot::messages);
+    metric_counter(out, "send_overhead_sent_bytes_total", "Bytes of the completed sends.", seg, &MetricSlot::bytes);
+    metric_counter(out, "send_overhead_send_errors_total", "Sends that failed.", seg, &MetricSlot::send_errors);
+    metric_histogram(out, "send_overhead_send_latency_seconds", "Trigger-to-send-completion latency.", seg, true);
+    metric_histogram(out, "send_overhead_matmul_seconds", "Matmul time per thread and iteration.", seg, false);
+    return out;
+}
+
+// Answers every connection with one HTTP/1.0 response holding the current metrics, so both
+// `curl --unix-socket <path> http://localhost/metrics` and a Prometheus proxy can scrape it.
+void* metrics_main(void* arg) {
+    MetricsExporter* ex = (MetricsExporter*)arg;
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ex->core_id >= 0 && ex->core_id < num_cores) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(ex->core_id, &cpuset);
+        pid_t tid = syscall(SYS_gettid);
+        sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+    }
+    while (!ex->stopping.load(std::memory_order_acquire)) {
+        struct pollfd pfd = {ex->listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        int fd = accept(ex->listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        // Read the request head, if the client sends one; its content does not matter.
+        struct timeval tv = {0, 100000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char req[1024];
+        std::string head;
+        ssize_t n;
+        while (head.find("\r\n\r\n") == std::string::npos && head.size() < 8192 &&
+               (n = recv(fd, req, sizeof(req), 0)) > 0) {
+            head.append(req, n);
+        }
+        std::string body = metrics_text(ex->seg);
+        std::string resp = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\n\r\n" + body;
+        for (size_t off = 0; off < resp.size();) {
+            ssize_t w = send(fd, resp.data() + off, resp.size() - off, MSG_NOSIGNAL);
+            if (w <= 0) break;
+            off += w;
+        }
+        close(fd);
+        ex->scrapes++;
+    }
+    return nullptr;
+}
+
+// Creates the shared-memory segment with labels for the given slots and starts the exporter
+// on path. Returns false (with errno set) if the segment or the socket cannot be set up.
+bool metrics_start(MetricsExporter* ex, const char* path, const std::vector<std::string>& labels, int core_id) {
+    snprintf(ex->shm_name, sizeof(ex->shm_name), "/send_overhead.%d", (int)getpid());
+    int shm_fd = shm_open(ex->shm_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (shm_fd < 0) return false;
+    if (ftruncate(shm_fd, sizeof(MetricsSegment)) < 0) {
+        close(shm_fd);
+        shm_unlink(ex->shm_name);
+        return false;
+    }
+    void* mem = mmap(nullptr, sizeof(MetricsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (mem == MAP_FAILED) {
+        shm_unlink(ex->shm_name);
+        return false;
+    }
+    // The mapping is zero-filled, which is the initial state of every counter.
+    ex->seg = (MetricsSegment*)mem;
+    ex->seg->magic = METRICS_MAGIC;
+    ex->seg->slots = std::min((int)labels.size(), METRIC_SLOTS);
+    ex->seg->buckets = METRIC_BUCKETS;
+    ex->seg->pid = getpid();
+    for (uint32_t t = 0; t < ex->seg->slots; t++) {
+        snprintf(ex->seg->slot[t].label, sizeof(ex->seg->slot[t].label), "%s", labels[t].c_str());
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    ex->path = path;
+    ex->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ex->path.size() >= sizeof(addr.sun_path) || ex->listen_fd < 0) {
+        if (ex->listen_fd >= 0) close(ex->listen_fd);
+        munmap(ex->seg, sizeof(MetricsSegment));
+        shm_unlink(ex->shm_name);
+        errno = ex->listen_fd < 0 ? errno : ENAMETOOLONG;
+        return false;
+    }
+    memcpy(addr.sun_path, path, ex->path.size());
+    unlink(path);   // A socket left over from an earlier run.
+    if (bind(ex->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(ex->listen_fd, 8) < 0) {
+        int err = errno;
+        close(ex->listen_fd);
+        munmap(ex->seg, sizeof(MetricsSegment));
+        shm_unlink(ex->shm_name);
+        errno = err;
+        return false;
+    }
+    ex->core_id = core_id;
+    ex->stopping.store(false);
+    ex->scrapes = 0;
+    pthread_create(&ex->thread, nullptr, metrics_main, (void*)ex);
+    return true;
+}
+
+void metrics_stop(MetricsExporter* ex) {
+    ex->stopping.store(true, std::memory_order_release);
+    pthread_join(ex->thread, nullptr);
+    close(ex->listen_fd);
+    unlink(ex->path.c_str());
+    munmap(ex->seg, sizeof(MetricsSegment));
+    shm_unlink(ex->shm_name);
+}
+
+// Stops and frees a running exporter when main returns early, so no socket or shared-memory
+// segment is left behind.
+struct MetricsCleanup {
+    MetricsExporter*& ex;
+    ~MetricsCleanup() {
+        if (ex) {
+            metrics_stop(ex);
+            delete ex;
+        }
+    }
+};
+
+// Send-path accounting for one socket. Written only by whoever currently sends on that
+// socket (the async send thread, which is joined every iteration, or the socket's batcher).
+struct SendStats {
+    unsigned long messages = 0;    // Messages handed to the send path.
+    unsigned long syscalls = 0;    // send/writev/sendmmsg/setsockopt calls issued.
+    unsigned long bytes = 0;       // Bytes the kernel accepted.
+    unsigned long failed = 0;      // Messages dropped because no send thread could be started.
+    double cpu_time = 0.0;         // CPU seconds spent by the sending threads.
+    std::vector<double> latency_us;  // Trigger-to-send-completion latency per message.
+    MetricSlot* metrics = nullptr;   // Live metrics slot (--metrics), if any.
+};
+
+// Records one completed send of bytes with the given latency; bytes <= 0 is a failed send,
+// which only counts as a send error.
+void record_send(SendStats* stats, ssize_t bytes, double latency_us) {
+    if (bytes <= 0) {
+        if (stats->metrics) stats->metrics->send_errors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    stats->latency_us.push_back(latency_us);
+    if (stats->metrics) {
+        stats->metrics->messages.fetch_add(1, std::memory_order_relaxed);
+        stats->metrics->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        metric_observe(stats->metrics->send_buckets, &stats->metrics->send_ns, latency_us);
+    }
+}
+
 // Structure to pass parameters to the asynchronous send thread.
 struct AsyncSendParams {
     int sockfd;         // Socket descriptor for TCP connection.
     int core_id;        // Desired core (0-3) for async send.
     char* message;      // Message to send.
     size_t msg_len;     // Length of the message.
+    double trigger_time;  // omp_get_wtime() when the matmul thread fired the send.
+    SendStats* stats;   // Accounting for this socket.
+    bool has_prev;      // Earlier send thread on the same socket that must finish first.
+    pthread_t prev;
+};
+
+// Function that runs in a separate pthread to call send() asynchronously.
+void* async_send(void* arg) {
+    AsyncSendParams* params = (AsyncSendParams*) arg;
+    
+    // Set CPU affinity to the desired core (0-3).
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(params->core_id, &cpuset);
+    pid_t tid = syscall(SYS_gettid);
+    if (sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset) != 0) {
+        // Error handling can be added here if needed.
+    }
+    rt_apply(RT_SEND);
+
+    // Keep messages on one socket in order (and their frames from interleaving).
+    if (params->has_prev) {
+        pthread_join(params->prev, nullptr);
+    }
+    
+    // Send 1KB data in a blocking call.
+    ssize_t bytes_sent = send(params->sockfd, params->message, params->msg_len, 0);
+
+    SendStats* stats = params->stats;
+    stats->messages++;
+    stats->syscalls++;
+    if (bytes_sent > 0) stats->bytes += bytes_sent;
+    record_send(stats, bytes_sent, (omp_get_wtime() - params->trigger_time) * 1000000);
+    stats->cpu_time += thread_cpu_time();
+    
+    // Free the allocated memory.
+    free(params->message);
+    delete params;
+    pthread_exit(nullptr);
+}
+
+// UDP segmentation offload (--udp_gso=1): one send of equal-size datagrams, split by the
+// kernel (or the NIC). Values from linux/udp.h, for older headers.
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES 65000
+
+// Sends n datagrams (one iovec each) with sendmmsg. With gso, runs of equal-size datagrams go
+// out as one UDP_SEGMENT message. Returns the number of datagrams the kernel accepted.
+size_t send_datagram_batch(int fd, const struct iovec* iov, size_t n, bool gso, SendStats* stats) {
+    std::vector<struct mmsghdr> msgs(n);
+    std::vector<size_t> run_len(n);
+    std::vector<char> ctrl(n * CMSG_SPACE(sizeof(uint16_t)), 0);
+    memset(msgs.data(), 0, n * sizeof(struct mmsghdr));
+    size_t num = 0;
+    for (size_t m = 0; m < n; num++) {
+        size_t run = 1;
+        while (gso && m + run < n && run < UDP_GSO_MAX_SEGMENTS && iov[m + run].iov_len == iov[m].iov_len &&
+               (run + 1) * iov[m].iov_len <= UDP_GSO_MAX_BYTES) {
+            run++;
+        }
+        struct msghdr& h = msgs[num].msg_hdr;
+        h.msg_iov = (struct iovec*)&iov[m];
+        h.msg_iovlen = run;
+        if (run > 1) {
+            h.msg_control = &ctrl[num * CMSG_SPACE(sizeof(uint16_t))];
+            h.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            struct cmsghdr* cm = CMSG_FIRSTHDR(&h);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = iov[m].iov_len;
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+        run_len[num] = run;
+        m += run;
+    }
+    size_t sent_msgs = 0, done = 0;
+    while (done < num) {
+        int sent = sendmmsg(fd, &msgs[done], num - done, 0);
+        stats->syscalls++;
+        if (sent <= 0) break;
+        for (int k = 0; k < sent; k++) {
+            stats->bytes += msgs[done + k].msg_len;
+            sent_msgs += run_len[done + k];
+        }
+        done += sent;
+    }
+    return sent_msgs;
+}
+
+// A message waiting in a SendBatcher.
+struct PendingMsg {
+    char* data;
+    size_t len;
+    double enqueue_time;  // omp_get_wtime() at enqueue.
+};
+
+// Coalesces the messages queued for one socket and submits them with a single writev()
+// (sendmmsg() for datagram sockets) once either the byte window fills up or the oldest
+// pending message has waited window_us. Runs one long-lived flusher thread pinned to a
+// send core instead of one pthread per message.
+struct SendBatcher {
+    int sockfd;
+    int core_id;
+    bool datagram;
+    bool gso;               // Datagram sockets: merge equal-size datagrams with UDP_SEGMENT.
+    bool cork;              // Wrap every flush in TCP_CORK on/off.
+    size_t window_bytes;
+    double window_us;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::vector<PendingMsg> pending;
+    size_t pending_bytes;
+    bool stopping;
+    pthread_t thread;
+    SendStats stats;
+};
+
+// Submits one batch. Partial writes are resumed; every syscall is counted.
+void batcher_flush(SendBatcher* b, std::vector<PendingMsg>& batch) {
+    if (b->cork && !b->datagram) {
+        int on = 1;
+        setsockopt(b->sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        b->stats.syscalls++;
+    }
+    std::vector<char> lost(batch.size(), 0);   // Stream messages a failed writev left unsent.
+    size_t done = 0;
+    while (done < batch.size()) {
+        size_t n = std::min(batch.size() - done, (size_t)IOV_MAX);
+        if (b->datagram) {
+            // One datagram per message; a datagram the kernel refuses is dropped, not retried.
+            std::vector<struct iovec> iov(n);
+            for (size_t m = 0; m < n; m++) {
+                iov[m].iov_base = batch[done + m].data;
+                iov[m].iov_len = batch[done + m].len;
+            }
+            send_datagram_batch(b->sockfd, iov.data(), n, b->gso, &b->stats);
+            done += n;
+        } else {
+            // One byte stream; resume inside a message after a short write.
+            std::vector<struct iovec> iov(n);
+            for (size_t m = 0; m < n; m++) {
+                iov[m].iov_base = batch[done + m].data;
+                iov[m].iov_len = batch[done + m].len;
+            }
+            size_t first = 0;
+            while (first < n) {
+                ssize_t written = writev(b->sockfd, &iov[first], n - first);
+                b->stats.syscalls++;
+                if (written <= 0) {
+                    std::fill(lost.begin() + done + first, lost.begin() + done + n, 1);
+                    first = n;
+                    break;
+                }
+                b->stats.bytes += written;
+                while (first < n && (size_t)written >= iov[first].iov_len) {
+                    written -= iov[first].iov_len;
+                    first++;
+                }
+                if (first < n) {
+                    iov[first].iov_base = (char*)iov[first].iov_base + written;
+                    iov[first].iov_len -= written;
+                }
+            }
+            done += n;
+        }
+    }
+    if (b->cork && !b->datagram) {
+        int off = 0;
+        setsockopt(b->sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        b->stats.syscalls++;
+    }
+    double now = omp_get_wtime();
+    for (size_t i = 0; i < batch.size(); i++) {
+        record_send(&b->stats, lost[i] ? -1 : (ssize_t)batch[i].len, (now - batch[i].enqueue_time) * 1000000);
+        free(batch[i].data);
+    }
+    batch.clear();
+}
+
+void* batcher_main(void* arg) {
+    SendBatcher* b = (SendBatcher*) arg;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(b->core_id, &cpuset);
+    pid_t tid = syscall(SYS_gettid);
+    sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+    rt_apply(RT_SEND);
+
+    std::vector<PendingMsg> batch;
+    pthread_mutex_lock(&b->lock);
+    while (true) {
+        while (b->pending.empty() && !b->stopping) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+        if (b->pending.empty() && b->stopping) break;
+
+        // Hold the batch open until the byte window fills or the oldest message times out.
+        double deadline = b->pending.front().enqueue_time + b->window_us * 1e-6;
+        while (!b->stopping && b->pending_bytes < b->window_bytes) {
+            double remaining = deadline - omp_get_wtime();
+            if (remaining <= 0) break;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            long ns = ts.tv_nsec + (long)(remaining * 1e9);
+            ts.tv_sec += ns / 1000000000L;
+            ts.tv_nsec = ns % 1000000000L;
+            pthread_cond_timedwait(&b->cond, &b->lock, &ts);
+        }
+        batch.swap(b->pending);
+        b->pending_bytes = 0;
+        pthread_mutex_unlock(&b->lock);
+        batcher_flush(b, batch);
+        pthread_mutex_lock(&b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+    b->stats.cpu_time += thread_cpu_time();
+    return nullptr;
+}
+
+void batcher_start(SendBatcher* b, int sockfd, int core_id, bool cork, size_t window_bytes, double window_us,
+                   bool gso) {
+    b->sockfd = sockfd;
+    b->core_id = core_id;
+    int type = SOCK_STREAM;
+    socklen_t len = sizeof(type);
+    getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &len);
+    b->datagram = (type == SOCK_DGRAM);
+    b->gso = gso && b->datagram;
+    b->cork = cork;
+    b->window_bytes = window_bytes;
+    b->window_us = window_us;
+    pthread_mutex_init(&b->lock, nullptr);
+    pthread_cond_init(&b->cond, nullptr);
+    b->pending_bytes = 0;
+    b->stopping = false;
+    pthread_create(&b->thread, nullptr, batcher_main, (void*) b);
+}
+
+// Queues a malloc'ed message; the batcher frees it once sent.
+void batcher_enqueue(SendBatcher* b, char* message, size_t len) {
+    pthread_mutex_lock(&b->lock);
+    b->pending.push_back({message, len, omp_get_wtime()});
+    b->pending_bytes += len;
+    b->stats.messages++;
+    bool wake = b->pending.size() == 1 || b->pending_bytes >= b->window_bytes;
+    pthread_mutex_unlock(&b->lock);
+    if (wake) pthread_cond_signal(&b->cond);
+}
+
+// Flushes whatever is still pending and joins the flusher thread.
+void batcher_stop(SendBatcher* b) {
+    pthread_mutex_lock(&b->lock);
+    b->stopping = true;
+    pthread_mutex_unlock(&b->lock);
+    pthread_cond_signal(&b->cond);
+    pthread_join(b->thread, nullptr);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->cond);
+}
+
+// Hands one malloc'ed message to the send path: the socket's batcher when batching,
+// otherwise a fresh pthread pinned to core_id. If prev is given, the new thread joins that
+// earlier send thread before sending, so only the newest thread needs to be joined.
+// Returns true if a thread was started.
+bool launch_send(int sockfd, int core_id, char* message, size_t len, SendBatcher* batcher,
+                 SendStats* stats, pthread_t* thread, const pthread_t* prev) {
+    if (batcher) {
+        batcher_enqueue(batcher, message, len);
+        return false;
+    }
+    AsyncSendParams* send_params = new AsyncSendParams;
+    send_params->sockfd = sockfd;
+    send_params->core_id = core_id;
+    send_params->message = message;
+    send_params->msg_len = len;
+    send_params->trigger_time = omp_get_wtime();
+    send_params->stats = stats;
+    send_params->has_prev = prev != nullptr;
+    if (prev) send_params->prev = *prev;
+    // On failure *thread keeps the earlier handle, which the caller still has to join.
+    pthread_t created;
+    int err = pthread_create(&created, nullptr, async_send, (void*) send_params);
+    if (err != 0) {
+        stats->failed++;
+        if (stats->failed == 1) std::cerr << "Cannot start a send thread: " << strerror(err) << std::endl;
+        free(message);
+        delete send_params;
+        return false;
+    }
+    *thread = created;
+    return true;
+}
+
+// Declarative send schedule (--send_schedule=...). Each entry makes one compute thread hand a
+// message to the send path once its matmul has reached a fraction of its rows; a thread may
+// have any number of entries per iteration.
+enum SendTransport {
+    TRANSPORT_THREAD = 0,   // One pthread per message, pinned to the entry's core.
+    TRANSPORT_BATCH = 1,    // The socket's SendBatcher.
+    TRANSPORT_INLINE = 2,   // Blocking send() from the compute thread itself.
+    TRANSPORT_MUX = 3,      // The rank's single multiplexed connection (see MuxSender).
+    TRANSPORT_CORO = 4,     // A coroutine on the executor (see CoroExecutor), awaited per iteration.
+    NUM_TRANSPORTS
+};
+const char* transport_names[NUM_TRANSPORTS] = {"thread", "batch", "inline", "mux", "coro"};
+
+struct SendEntry {
+    int thread;         // Compute thread that triggers the send.
+    double at;          // Fraction of the thread's rows computed before the send fires.
+    size_t bytes;       // Message size.
+    int core;           // Send core for the thread transport (-1: the thread's default).
+    int transport;      // SendTransport.
+    int row;            // Trigger row, precomputed per thread from `at`.
+};
+
+// Parses "threads@fractions[:bytes[:core[:transport]]][+...]", e.g.
+// "0-2@0.25:2560+3@0.5,0.9:1024:7:inline". Empty fields take the defaults. A spec of the
+// form "@file" is read from that file, one entry per line, '#' starting a comment.
+bool parse_send_schedule(std::string spec, size_t default_bytes, int default_transport,
+                         std::vector<SendEntry>& entries) {
+    if (!spec.empty() && spec[0] == '@') {
+        FILE* f = fopen(spec.c_str() + 1, "r");
+        if (!f) return false;
+        char line[4096];
+        spec.clear();
+        while (fgets(line, sizeof(line), f)) {
+            std::string s(line);
+            s = s.substr(0, s.find('#'));
+            s.erase(std::remove_if(s.begin(), s.end(), ::isspace), s.end());
+            if (s.empty()) continue;
+            if (!spec.empty()) spec += '+';
+            spec += s;
+        }
+        fclose(f);
+    }
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t plus = spec.find('+', pos);
+        std::string item = spec.substr(pos, plus == std::string::npos ? std::string::npos : plus - pos);
+        size_t at = item.find('@');
+        if (at == std::string::npos) return false;
+        std::vector<int> threads = parse_core_list(item.substr(0, at));
+        std::vector<std::string> fields;
+        std::string rest = item.substr(at + 1);
+        for (size_t fpos = 0;;) {
+            size_t colon = rest.find(':', fpos);
+            fields.push_back(rest.substr(fpos, colon == std::string::npos ? std::string::npos : colon - fpos));
+            if (colon == std::string::npos) break;
+            fpos = colon + 1;
+        }
+        size_t bytes = fields.size() > 1 && !fields[1].empty() ? std::atol(fields[1].c_str()) : default_bytes;
+        int core = fields.size() > 2 && !fields[2].empty() ? std::atoi(fields[2].c_str()) : -1;
+        int transport = default_transport;
+        if (fields.size() > 3 && !fields[3].empty()) {
+            transport = -1;
+            for (int t = 0; t < NUM_TRANSPORTS; t++) {
+                if (fields[3] == transport_names[t]) transport = t;
+            }
+        }
+        if (threads.empty() || fields[0].empty() || fields.size() > 4 || transport < 0 || bytes == 0) return false;
+        for (size_t fpos = 0;;) {
+            size_t comma = fields[0].find(',', fpos);
+            double frac = std::atof(fields[0].substr(fpos, comma == std::string::npos ? std::string::npos : comma - fpos).c_str());
+            if (frac < 0.0 || frac >= 1.0) return false;
+            for (int t : threads) entries.push_back({t, frac, bytes, core, transport, 0});
+            if (comma == std::string::npos) break;
+            fpos = comma + 1;
+        }
+        if (plus == std::string::npos) break;
+        pos = plus + 1;
+    }
+    return true;
+}
+
+// The entries of one thread with their trigger rows in [start, end), in firing order.
+std::vector<SendEntry> thread_send_schedule(const std::vector<SendEntry>& entries, int thread_id,
+                                            int start, int end, int default_core) {
+    std::vector<SendEntry> mine;
+    for (const SendEntry& e : entries) {
+        if (e.thread != thread_id) continue;
+        SendEntry s = e;
+        s.row = start + (int)(e.at * (end - start));
+        if (s.core < 0) s.core = default_core;
+        mine.push_back(s);
+    }
+    std::stable_sort(mine.begin(), mine.end(), [](const SendEntry& a, const SendEntry& b) { return a.row < b.row; });
+    return mine;
+}
+
+// Blocking send() from the calling thread; frees the message.
+void send_inline(int sockfd, char* message, size_t len, SendStats* stats) {
+    double trigger_time = omp_get_wtime();
+    double cpu_start = thread_cpu_time();
+    ssize_t bytes_sent = send(sockfd, message, len, 0);
+    stats->messages++;
+    stats->syscalls++;
+    if (bytes_sent > 0) stats->bytes += bytes_sent;
+    record_send(stats, bytes_sent, (omp_get_wtime() - trigger_time) * 1000000);
+    stats->cpu_time += thread_cpu_time() - cpu_start;
+    free(message);
+}
+
+// Multiplexed transport (--mux=1, or "mux" in the send schedule): one connection per rank
+// instead of one per compute thread. Every message travels behind a MuxHeader tagged with its
+// channel (the compute thread) and the server demultiplexes by channel (wire_format.h).
+
+// A queued message; header and payload go out as two iovecs, so the payload is not copied.
+struct MuxNode {
+    std::atomic<MuxNode*> next;
+    MuxHeader hdr;
+    char* payload;          // malloc'ed, freed once sent.
+    double enqueue_time;    // omp_get_wtime() at submission.
+};
+
+// Lock-free multi-producer single-consumer queue (Vyukov's intrusive MPSC): a producer
+// publishes a node with one exchange on head; only the mux sender thread pops from tail.
+struct MuxQueue {
+    alignas(64) std::atomic<MuxNode*> head;
+    alignas(64) MuxNode* tail;
+    MuxNode stub;
+};
+
+void mux_queue_init(MuxQueue* q) {
+    q->stub.next.store(nullptr, std::memory_order_relaxed);
+    q->head.store(&q->stub, std::memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+void mux_queue_push(MuxQueue* q, MuxNode* n) {
+    n->next.store(nullptr, std::memory_order_relaxed);
+    MuxNode* prev = q->head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+}
+
+// Returns the oldest node, or nullptr if the queue is empty or a producer is between its
+// exchange and its link (the node shows up on a later call).
+MuxNode* mux_queue_pop(MuxQueue* q) {
+    MuxNode* tail = q->tail;
+    MuxNode* next = tail->next.load(std::memory_order_acquire);
+    if (tail == &q->stub) {
+        if (!next) return nullptr;
+        q->tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != q->head.load(std::memory_order_acquire)) return nullptr;
+    // tail is the last node: put the stub behind it so tail can be handed out.
+    mux_queue_push(q, &q->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+// True if nothing is queued and no push is in progress (consumer side only).
+bool mux_queue_empty(MuxQueue* q) {
+    return q->tail == &q->stub && q->head.load(std::memory_order_acquire) == &q->stub;
+}
+
+// The rank's connection and the thread that drains the queue into it with writev().
+struct MuxSender {
+    int sockfd;
+    int core_id;
+    MuxQueue queue;
+    alignas(64) std::atomic<int> wake;       // Futex word, bumped to wake a sleeping sender.
+    std::atomic<int> sleeping;
+    std::atomic<bool> stopping;
+    uint32_t seq[MAX_MUX_CHANNELS];          // seq[c] is only touched by channel c's producer.
+    int spin_limit;                          // Empty polls before the sender sleeps.
+    std::atomic<unsigned long> written;      // Messages fully written, readable by any thread.
+    pthread_t thread;
+    SendStats stats;
+};
+
+// Submits one malloc'ed message on a channel; the sender frees it once written.
+void mux_submit(MuxSender* m, int channel, char* message, size_t len) {
+    MuxNode* n = new MuxNode;
+    n->hdr.magic = MUX_MAGIC;
+    n->hdr.channel = (uint16_t)channel;
+    n->hdr.flags = 0;
+    n->hdr.seq = m->seq[channel]++;
+    n->hdr.bytes = (uint32_t)len;
+    n->payload = message;
+    n->enqueue_time = omp_get_wtime();
+    mux_queue_push(&m->queue, n);
+    // Pairs with the fence in mux_main: either the sender sees the node or we see it asleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m->sleeping.load(std::memory_order_relaxed)) {
+        m->wake.fetch_add(1, std::memory_order_relaxed);
+        syscall(SYS_futex, (int*)&m->wake, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+}
+
+void* mux_main(void* arg) {
+    MuxSender* m = (MuxSender*) arg;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(m->core_id, &cpuset);
+    pid_t tid = syscall(SYS_gettid);
+    sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+    rt_apply(RT_SEND);
+
+    std::vector<MuxNode*> batch;
+    std::vector<struct iovec> iov;
+    int idle = 0;
+    while (true) {
+        // Take whatever is queued, up to IOV_MAX / 2 messages per writev.
+        MuxNode* n;
+        while (batch.size() < IOV_MAX / 2 && (n = mux_queue_pop(&m->queue)) != nullptr) batch.push_back(n);
+        if (batch.empty()) {
+            if (m->stopping.load(std::memory_order_acquire) && mux_queue_empty(&m->queue)) break;
+            if (++idle < m->spin_limit) {
+                _mm_pause();
+                continue;
+            }
+            int w = m->wake.load(std::memory_order_relaxed);
+            m->sleeping.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (mux_queue_empty(&m->queue) && !m->stopping.load()) {
+                struct timespec timeout = {0, 10 * 1000000L};
+                syscall(SYS_futex, (int*)&m->wake, FUTEX_WAIT_PRIVATE, w, &timeout, nullptr, 0);
+            }
+            m->sleeping.store(0, std::memory_order_relaxed);
+            idle = 0;
+            continue;
+        }
+        idle = 0;
+        iov.clear();
+        for (MuxNode* b : batch) {
+            iov.push_back({&b->hdr, sizeof(MuxHeader)});
+            iov.push_back({b->payload, b->hdr.bytes});
+        }
+        // One byte stream; resume inside an iovec after a short write.
+        size_t first = 0;
+        while (first < iov.size()) {
+            ssize_t written = writev(m->sockfd, &iov[first], std::min(iov.size() - first, (size_t)IOV_MAX));
+            m->stats.syscalls++;
+            if (written <= 0) break;
+            m->stats.bytes += written;
+            while (first < iov.size() && (size_t)written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                first++;
+            }
+            if (first < iov.size()) {
+                iov[first].iov_base = (char*)iov[first].iov_base + written;
+                iov[first].iov_len -= written;
+            }
+        }
+        // A failed writev leaves every message from the one holding iov[first] unsent.
+        size_t lost_from = first / 2;
+        double now = omp_get_wtime();
+        for (size_t i = 0; i < batch.size(); i++) {
+            MuxNode* b = batch[i];
+            m->stats.messages++;
+            record_send(&m->stats, i < lost_from ? (ssize_t)(sizeof(MuxHeader) + b->hdr.bytes) : -1,
+                        (now - b->enqueue_time) * 1000000);
+            free(b->payload);
+            delete b;
+        }
+        m->written.fetch_add(batch.size(), std::memory_order_release);
+        batch.clear();
+    }
+    m->stats.cpu_time += thread_cpu_time();
+    return nullptr;
+}
+
+void mux_start(MuxSender* m, int sockfd, int core_id, int spin_limit) {
+    m->sockfd = sockfd;
+    m->core_id = core_id;
+    mux_queue_init(&m->queue);
+    m->wake.store(0);
+    m->sleeping.store(0);
+    m->stopping.store(false);
+    memset(m->seq, 0, sizeof(m->seq));
+    m->spin_limit = spin_limit;
+    m->written.store(0);
+    pthread_create(&m->thread, nullptr, mux_main, (void*) m);
+}
+
+// Sends whatever is still queued and joins the sender thread.
+void mux_stop(MuxSender* m) {
+    m->stopping.store(true, std::memory_order_release);
+    m->wake.fetch_add(1);
+    syscall(SYS_futex, (int*)&m->wake, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    pthread_join(m->thread, nullptr);
+}
+
+// Blocking TCP connection to ip:port; -1 with errno set on failure.
+int open_connection(const std::string& ip, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Socket per thread vs one multiplexed connection (--mux_bench=<messages>): `threads` threads
+// on first_core.. each send `messages` messages of `bytes` back to back, first each with
+// blocking send() on its own connection, then all through one MuxSender on send_core.
+// Latency is send() duration for the former and submission to write completion for the mux.
+void compare_send_layouts(const std::string& ip, int port, int threads, int messages, size_t bytes,
+                          int first_core, int send_core) {
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<int> fds(threads, -1);
+    for (int t = 0; t < threads; t++) fds[t] = open_connection(ip, port);
+    int mux_fd = open_connection(ip, port);
+    if (mux_fd < 0 || std::count(fds.begin(), fds.end(), -1) > 0) {
+        std::cerr << "Send layout comparison: connection failed: " << strerror(errno) << std::endl;
+        for (int fd : fds) if (fd >= 0) close(fd);
+        if (mux_fd >= 0) close(mux_fd);
+        return;
+    }
+    std::vector<SendStats> per_socket(threads);
+    MuxSender* mux = new MuxSender;
+    mux_start(mux, mux_fd, std::min(send_core, num_cores - 1), 2000);
+    double wall[2] = {0.0, 0.0};
+
+    for (int layout = 0; layout < 2; layout++) {
+        double t0 = 0.0;
+        #pragma omp parallel num_threads(threads)
+        {
+            int t = omp_get_thread_num();
+            if (first_core + t < num_cores) {
+                cpu_set_t cpuset;
+                CPU_ZERO(&cpuset);
+                CPU_SET(first_core + t, &cpuset);
+                pid_t tid = syscall(SYS_gettid);
+                sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+            }
+            #pragma omp barrier
+            #pragma omp single
+            t0 = omp_get_wtime();
+            for (int i = 0; i < messages; i++) {
+                char* message = (char*)malloc(bytes);
+                memset(message, 'A', bytes);
+                if (layout == 0) {
+                    send_inline(fds[t], message, bytes, &per_socket[t]);
+                } else {
+                    mux_submit(mux, t, message, bytes);
+                }
+            }
+        }
+        if (layout == 1) {
+            // Done once the sender has written every message.
+            while (mux->written.load(std::memory_order_acquire) < (unsigned long)threads * messages) usleep(50);
+            mux_stop(mux);
+        }
+        wall[layout] = omp_get_wtime() - t0;
+    }
+
+    SendStats total;
+    for (SendStats& st : per_socket) {
+        total.syscalls += st.syscalls;
+        total.cpu_time += st.cpu_time;
+        total.latency_us.insert(total.latency_us.end(), st.latency_us.begin(), st.latency_us.end());
+    }
+    double msgs = (double)threads * messages;
+    printf("Send layouts, %d threads x %d messages of %zu bytes:\n", threads, messages, bytes);
+    printf("%-18s %8s %10s %10s %10s %10s %13s\n", "layout", "conns", "msgs/s", "MB/s", "p50 us", "p99 us", "syscalls/msg");
+    for (int layout = 0; layout < 2; layout++) {
+        SendStats& st = layout == 0 ? total : mux->stats;
+        printf("%-18s %8d %10.0f %10.1f %10.1f %10.1f %13.3f\n", layout == 0 ? "socket per thread" : "mux",
+               layout == 0 ? threads : 1, msgs / wall[layout], msgs * bytes / wall[layout] / 1e6,
+               percentile(st.latency_us, 50), percentile(st.latency_us, 99), st.syscalls / msgs);
+    }
+    for (int fd : fds) close(fd);
+    close(mux_fd);
+    delete mux;
+}
+
+// Connected UDP socket to ip:port (--udp=1); -1 with errno set on failure. The send buffer is
+// enlarged since nothing is retransmitted if it overflows.
+int open_udp(const std::string& ip, int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    int sndbuf = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &serv_addr.sin_addr) <= 0 ||
+        connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err ? err : EINVAL;
+        return -1;
+    }
+    return fd;
+}
+
+// Largest payload one datagram carries behind its MuxHeader.
+#define UDP_MAX_PAYLOAD (65507 - sizeof(MuxHeader))
+
+// Puts a malloc'ed message behind a MuxHeader (channel and sequence number, so the server can
+// count lost and late datagrams) in a new allocation; frees the original.
+char* udp_datagram(char* message, size_t* len, int channel, uint32_t seq) {
+    char* datagram = (char*)malloc(sizeof(MuxHeader) + *len);
+    MuxHeader hdr = {MUX_MAGIC, (uint16_t)channel, 0, seq, (uint32_t)*len};
+    memcpy(datagram, &hdr, sizeof(hdr));
+    memcpy(datagram + sizeof(hdr), message, *len);
+    free(message);
+    *len += sizeof(hdr);
+    return datagram;
+}
+
+// TCP vs UDP on the send path (--udp_bench=<messages>): `threads` threads on first_core.. each
+// send `messages` sequence-numbered messages of `bytes`: one send() each on TCP and on UDP, then
+// UDP in sendmmsg batches of 32, then (with gso) the same batches merged by UDP_SEGMENT.
+// Prints throughput and sender CPU per message; the server reports its side and UDP loss.
+void compare_udp_tcp(const std::string& ip, int port, int threads, int messages, size_t bytes,
+                     int first_core, bool gso) {
+    const char* names[4] = {"tcp send", "udp send", "udp sendmmsg x32", "udp gso x32"};
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int layouts = gso ? 4 : 3;
+    printf("TCP vs UDP, %d threads x %d messages of %zu bytes:\n", threads, messages, bytes);
+    printf("%-18s %10s %10s %12s %13s %10s\n", "layout", "msgs/s", "MB/s", "cpu us/msg", "syscalls/msg", "refused");
+    for (int layout = 0; layout < layouts; layout++) {
+        std::vector<int> fds(threads);
+        bool ok = true;
+        for (int t = 0; t < threads; t++) {
+            fds[t] = layout == 0 ? open_connection(ip, port) : open_udp(ip, port);
+            ok = ok && fds[t] >= 0;
+        }
+        if (!ok) {
+            printf("%-18s connection failed: %s\n", names[layout], strerror(errno));
+            for (int fd : fds) if (fd >= 0) close(fd);
+            continue;
+        }
+        std::vector<SendStats> stats(threads);
+        std::vector<unsigned long> accepted(threads, 0);
+        double t0 = 0.0;
+        #pragma omp parallel num_threads(threads)
+        {
+            int t = omp_get_thread_num();
+            if (first_core + t < num_cores) {
+                cpu_set_t cpuset;
+                CPU_ZERO(&cpuset);
+                CPU_SET(first_core + t, &cpuset);
+                pid_t tid = syscall(SYS_gettid);
+                sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+            }
+            // Every message is built before the clock starts; only the sending is timed.
+            std::vector<char*> msgs(messages);
+            std::vector<struct iovec> iov(messages);
+            for (int i = 0; i < messages; i++) {
+                size_t len = bytes;
+                char* message = (char*)malloc(bytes);
+                memset(message, 'A', bytes);
+                msgs[i] = udp_datagram(message, &len, t, i);
+                iov[i] = {msgs[i], len};
+            }
+            #pragma omp barrier
+            #pragma omp single
+            t0 = omp_get_wtime();
+            double cpu_start = thread_cpu_time();
+            if (layout <= 1) {
+                for (int i = 0; i < messages; i++) {
+                    ssize_t sent = send(fds[t], iov[i].iov_base, iov[i].iov_len, 0);
+                    stats[t].syscalls++;
+                    if (sent > 0) {
+                        stats[t].bytes += sent;
+                        accepted[t]++;
+                    }
+                }
+            } else {
+                for (int i = 0; i < messages; i += 32) {
+                    accepted[t] += send_datagram_batch(fds[t], &iov[i], std::min(32, messages - i), layout == 3, &stats[t]);
+                }
+            }
+            stats[t].cpu_time = thread_cpu_time() - cpu_start;
+            for (char* m : msgs) free(m);
+        }
+        double wall = omp_get_wtime() - t0;
+        double cpu = 0.0, syscalls = 0.0, sent_bytes = 0.0;
+        unsigned long total_accepted = 0;
+        for (int t = 0; t < threads; t++) {
+            cpu += stats[t].cpu_time;
+            syscalls += stats[t].syscalls;
+            sent_bytes += stats[t].bytes;
+            total_accepted += accepted[t];
+        }
+        double msgs = (double)threads * messages;
+        printf("%-18s %10.0f %10.1f %12.2f %13.3f %10.0f\n", names[layout], msgs / wall, sent_bytes / wall / 1e6,
+               cpu * 1e6 / msgs, syscalls / msgs, msgs - total_accepted);
+        for (int fd : fds) close(fd);
+    }
+}
+
+#if HAVE_COROUTINES
+// Coroutine executor (--coro=1, or "coro" in the send schedule; needs -std=c++20). Sends run
+// as coroutines on an epoll reactor pinned to a communication core: a send that would block
+// suspends until the socket is writable instead of holding a thread. Compute threads launch an
+// operation, get a CommOp back and wait for it at the iteration boundary (comm_wait).
+enum CommState { COMM_PENDING = 0, COMM_DONE = 1, COMM_SLEEPING = 2 };
+
+// Owned jointly by the executor and the launching thread; whichever lets go last frees it.
+struct CommOp {
+    std::atomic<int> state{COMM_PENDING};   // Futex word.
+    std::atomic<int> refs{2};
+    ssize_t result = 0;                     // Bytes sent or received (-1 on error).
+};
+
+struct CoroExecutor;
+
+// A collective: completes for every member once all `members` contributions have been sent.
+struct CommGroup {
+    int members = 0;
+    std::mutex lock;
+    int arrived = 0;
+    std::vector<std::pair<CoroExecutor*, std::coroutine_handle<>>> waiters;
+};
+
+// Per-socket state, touched only by the executor thread: the send turn keeps messages on one
+// socket in order, and at most one coroutine waits per direction.
+struct CoroSocket {
+    bool busy = false;
+    std::deque<std::coroutine_handle<>> turn;
+    std::coroutine_handle<> readable, writable;
+    bool registered = false;
+};
+
+struct CoroExecutor {
+    int core_id;
+    int epfd;
+    int wake_fd;                                      // eventfd the reactor also polls.
+    std::mutex lock;
+    std::vector<std::coroutine_handle<>> submitted;   // Handed over by other threads.
+    alignas(64) std::atomic<int> pending{0};
+    std::atomic<int> sleeping{0};
+    std::atomic<int> inflight{0};                     // Launched operations not yet completed.
+    std::atomic<bool> stopping{false};
+    std::deque<std::coroutine_handle<>> ready;        // Executor-local run queue.
+    std::unordered_map<int, CoroSocket> sockets;
+    int spin_limit;
+    int io_waiting = 0;                               // Coroutines parked in IoReady.
+    unsigned long resumes = 0;
+    unsigned long epoll_waits = 0;
+    double cpu_time = 0.0;
+    pthread_t thread;
+};
+
+// Fire-and-forget coroutine: created suspended, started on the executor, frame freed at the end.
+struct CoroTask {
+    struct promise_type {
+        CoroTask get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Queues a coroutine on the executor from any thread.
+void coro_schedule(CoroExecutor* ex, std::coroutine_handle<> h) {
+    {
+        std::lock_guard<std::mutex> g(ex->lock);
+        ex->submitted.push_back(h);
+    }
+    ex->pending.fetch_add(1);
+    // Pairs with the exchange in coro_main: either the reactor sees the handle or we see it asleep.
+    if (ex->sleeping.exchange(0)) {
+        uint64_t one = 1;
+        ssize_t w = write(ex->wake_fd, &one, sizeof(one));
+        (void)w;
+    }
+}
+
+void comm_complete(CoroExecutor* ex, CommOp* op, ssize_t result) {
+    op->result = result;
+    if (op->state.exchange(COMM_DONE, std::memory_order_acq_rel) == COMM_SLEEPING) {
+        syscall(SYS_futex, (int*)&op->state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+    if (op->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete op;
+    ex->inflight.fetch_sub(1);
+}
+
+// Blocks the calling (compute) thread until op completes: spins briefly, then sleeps on the
+// futex. Drops the caller's reference to op and returns its result.
+ssize_t comm_wait(CommOp* op) {
+    for (int i = 0; i < 2000 && op->state.load(std::memory_order_acquire) != COMM_DONE; i++) _mm_pause();
+    int expected = COMM_PENDING;
+    if (op->state.compare_exchange_strong(expected, COMM_SLEEPING, std::memory_order_acq_rel) ||
+        expected == COMM_SLEEPING) {
+        while (op->state.load(std::memory_order_acquire) != COMM_DONE) {
+            syscall(SYS_futex, (int*)&op->state, FUTEX_WAIT_PRIVATE, COMM_SLEEPING, nullptr, nullptr, 0);
+        }
+    }
+    ssize_t result = op->result;
+    if (op->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete op;
+    return result;
+}
+
+// Re-arms the one-shot epoll registration of fd for the directions that still have a waiter.
+void coro_arm(CoroExecutor* ex, int fd, CoroSocket& s) {
+    struct epoll_event ev;
+    ev.events = (uint32_t)EPOLLONESHOT | (s.readable ? (uint32_t)EPOLLIN : 0u) | (s.writable ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.fd = fd;
+    if (epoll_ctl(ex->epfd, s.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == 0) s.registered = true;
+}
+
+// co_await IoReady{ex, fd, EPOLLOUT}: resumes once fd is writable (EPOLLIN: readable).
+struct IoReady {
+    CoroExecutor* ex;
+    int fd;
+    uint32_t events;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        CoroSocket& s = ex->sockets[fd];
+        (events == EPOLLIN ? s.readable : s.writable) = h;
+        ex->io_waiting++;
+        coro_arm(ex, fd, s);
+    }
+    void await_resume() const noexcept {}
+};
+
+// co_await SendTurn{ex, fd}: waits until earlier sends on fd are done; pair with coro_release_turn.
+struct SendTurn {
+    CoroExecutor* ex;
+    int fd;
+    bool await_ready() {
+        CoroSocket& s = ex->sockets[fd];
+        if (s.busy) return false;
+        s.busy = true;
+        return true;
+    }
+    void await_suspend(std::coroutine_handle<> h) { ex->sockets[fd].turn.push_back(h); }
+    void await_resume() const noexcept {}
+};
+
+void coro_release_turn(CoroExecutor* ex, int fd) {
+    CoroSocket& s = ex->sockets[fd];
+    if (s.turn.empty()) {
+        s.busy = false;
+    } else {
+        ex->ready.push_back(s.turn.front());   // The turn passes on; busy stays set.
+        s.turn.pop_front();
+    }
+}
+
+// co_await GroupArrive{ex, group}: suspends until every member of the collective has arrived.
+struct GroupArrive {
+    CoroExecutor* ex;
+    CommGroup* group;
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        std::vector<std::pair<CoroExecutor*, std::coroutine_handle<>>> wake;
+        {
+            std::lock_guard<std::mutex> g(group->lock);
+            if (++group->arrived < group->members) {
+                group->waiters.push_back({ex, h});
+                return true;
+            }
+            wake.swap(group->waiters);
+        }
+        // Last to arrive: release the others (on their own executors) and carry on.
+        for (auto& w : wake) {
+            if (w.first == ex) ex->ready.push_back(w.second);
+            else coro_schedule(w.first, w.second);
+        }
+        return false;
+    }
+    void await_resume() const noexcept {}
+};
+
+// Writes all of message (then frees it), suspending whenever the socket buffer is full.
+CoroTask coro_send_task(CoroExecutor* ex, int fd, char* message, size_t len, double trigger_time,
+                        SendStats* stats, CommGroup* group, CommOp* op) {
+    co_await SendTurn{ex, fd};
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, message + sent, len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        stats->syscalls++;
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_await IoReady{ex, fd, EPOLLOUT};
+        } else if (!(n < 0 && errno == EINTR)) {
+            break;
+        }
+    }
+    coro_release_turn(ex, fd);
+    stats->messages++;
+    stats->bytes += sent;
+    record_send(stats, sent == len ? (ssize_t)sent : -1, (omp_get_wtime() - trigger_time) * 1000000);
+    free(message);
+    if (group) co_await GroupArrive{ex, group};
+    comm_complete(ex, op, sent == len ? (ssize_t)sent : -1);
+}
+
+// Reads exactly len bytes into buffer (fewer on EOF or error).
+CoroTask coro_recv_task(CoroExecutor* ex, int fd, char* buffer, size_t len, CommOp* op) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(fd, buffer + got, len - got, MSG_DONTWAIT);
+        if (n > 0) {
+            got += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            co_await IoReady{ex, fd, EPOLLIN};
+        } else if (!(n < 0 && errno == EINTR)) {
+            break;
+        }
+    }
+    comm_complete(ex, op, (ssize_t)got);
+}
+
+// Launches one malloc'ed message on the executor; the send frees it.
+CommOp* coro_send(CoroExecutor* ex, int fd, char* message, size_t len, SendStats* stats) {
+    CommOp* op = new CommOp;
+    ex->inflight.fetch_add(1);
+    coro_schedule(ex, coro_send_task(ex, fd, message, len, omp_get_wtime(), stats, nullptr, op).handle);
+    return op;
+}
+
+CommOp* coro_recv(CoroExecutor* ex, int fd, char* buffer, size_t len) {
+    CommOp* op = new CommOp;
+    ex->inflight.fetch_add(1);
+    coro_schedule(ex, coro_recv_task(ex, fd, buffer, len, op).handle);
+    return op;
+}
+
+// This member's contribution to a collective: its op completes once every member's is sent.
+CommOp* coro_collective(CoroExecutor* ex, CommGroup* group, int fd, char* message, size_t len, SendStats* stats) {
+    CommOp* op = new CommOp;
+    ex->inflight.fetch_add(1);
+    coro_schedule(ex, coro_send_task(ex, fd, message, len, omp_get_wtime(), stats, group, op).handle);
+    return op;
+}
+
+void* coro_main(void* arg) {
+    CoroExecutor* ex = (CoroExecutor*) arg;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(ex->core_id, &cpuset);
+    pid_t tid = syscall(SYS_gettid);
+    sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+    rt_apply(RT_SEND);
+
+    std::vector<std::coroutine_handle<>> batch;
+    struct epoll_event events[64];
+    int idle = 0;
+    while (true) {
+        if (ex->pending.load(std::memory_order_acquire) > 0) {
+            {
+                std::lock_guard<std::mutex> g(ex->lock);
+                batch.swap(ex->submitted);
+            }
+            ex->pending.fetch_sub(batch.size());
+            for (std::coroutine_handle<> h : batch) ex->ready.push_back(h);
+            batch.clear();
+        }
+        while (!ex->ready.empty()) {
+            std::coroutine_handle<> h = ex->ready.front();
+            ex->ready.pop_front();
+            ex->resumes++;
+            h.resume();
+        }
+        if (ex->stopping.load() && ex->inflight.load() == 0) break;
+
+        // Idle: spin on the submission count while no socket is awaited, poll epoll while one
+        // is, and sleep in epoll (10 ms at most) after spin_limit idle rounds.
+        int timeout = 0;
+        if (ex->pending.load() == 0) {
+            if (++idle < ex->spin_limit && ex->io_waiting == 0) {
+                _mm_pause();
+                continue;
+            }
+            if (idle >= ex->spin_limit) {
+                ex->sleeping.store(1);
+                timeout = ex->pending.load() > 0 ? 0 : 10;
+            }
+        }
+        int n = epoll_wait(ex->epfd, events, 64, timeout);
+        ex->epoll_waits++;
+        if (timeout) {
+            ex->sleeping.store(0);
+            idle = 0;
+        }
+        for (int e = 0; e < n; e++) {
+            int fd = events[e].data.fd;
+            if (fd == ex->wake_fd) {
+                uint64_t count;
+                ssize_t r = read(ex->wake_fd, &count, sizeof(count));
+                (void)r;
+                continue;
+            }
+            idle = 0;
+            CoroSocket& s = ex->sockets[fd];
+            uint32_t got = events[e].events;
+            bool any = got & (EPOLLERR | EPOLLHUP);
+            if (s.writable && (any || (got & EPOLLOUT))) {
+                ex->ready.push_back(s.writable);
+                s.writable = nullptr;
+                ex->io_waiting--;
+            }
+            if (s.readable && (any || (got & EPOLLIN))) {
+                ex->ready.push_back(s.readable);
+                s.readable = nullptr;
+                ex->io_waiting--;
+            }
+            if (s.readable || s.writable) coro_arm(ex, fd, s);
+        }
+    }
+    ex->cpu_time += thread_cpu_time();
+    return nullptr;
+}
+
+bool coro_start(CoroExecutor* ex, int core_id, int spin_limit) {
+    ex->core_id = core_id;
+    ex->spin_limit = spin_limit;
+    ex->epfd = epoll_create1(0);
+    ex->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (ex->epfd < 0 || ex->wake_fd < 0) return false;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = ex->wake_fd;
+    epoll_ctl(ex->epfd, EPOLL_CTL_ADD, ex->wake_fd, &ev);
+    return pthread_create(&ex->thread, nullptr, coro_main, (void*) ex) == 0;
+}
+
+// Finishes every launched operation and joins the reactor.
+void coro_stop(CoroExecutor* ex) {
+    ex->stopping.store(true);
+    uint64_t one = 1;
+    ssize_t w = write(ex->wake_fd, &one, sizeof(one));
+    (void)w;
+    pthread_join(ex->thread, nullptr);
+    close(ex->epfd);
+    close(ex->wake_fd);
+}
+
+// Scheduling overhead of the executor against pthread-per-send (--coro_bench=<rounds>): each of
+// `threads` threads on first_core.. runs `rounds` rounds of `burst` sends of `bytes` and waits
+// for them at the round boundary, as the matmul does at the end of an iteration: joining the
+// chained send threads, waiting for each coroutine send, or waiting for a collective across
+// all threads. Launch and wait are timed on the compute thread; send-side CPU covers the send
+// threads or the executors.
+void compare_coro_pthread(const std::string& ip, int port, int threads, int rounds, int burst, size_t bytes,
+                          int first_core, const std::vector<int>& exec_cores) {
+    const char* names[3] = {"pthread per send", "coroutine send", "coroutine collective"};
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Send executors, %d threads x %d rounds of %d x %zu bytes, %zu executor(s):\n", threads, rounds, burst,
+           bytes, exec_cores.size());
+    printf("%-22s %10s %12s %12s %10s %10s %12s\n", "layout", "msgs/s", "launch us", "wait us/rnd", "p50 us",
+           "p99 us", "cpu us/msg");
+    for (int layout = 0; layout < 3; layout++) {
+        std::vector<int> fds(threads);
+        bool ok = true;
+        for (int t = 0; t < threads; t++) {
+            fds[t] = open_connection(ip, port);
+            ok = ok && fds[t] >= 0;
+        }
+        if (!ok) {
+            printf("%-22s connection failed: %s\n", names[layout], strerror(errno));
+            for (int fd : fds) if (fd >= 0) close(fd);
+            continue;
+        }
+        std::vector<CoroExecutor*> execs;
+        for (size_t e = 0; layout > 0 && e < exec_cores.size(); e++) {
+            execs.push_back(new CoroExecutor);
+            coro_start(execs.back(), std::min(exec_cores[e], num_cores - 1), 2000);
+        }
+        std::vector<CommGroup> groups(layout == 2 ? rounds : 0);
+        for (CommGroup& g : groups) g.members = threads * burst;
+        std::vector<SendStats> stats(threads);
+        std::vector<double> launch(threads, 0.0), wait(threads, 0.0);
+        double t0 = 0.0;
+        #pragma omp parallel num_threads(threads)
+        {
+            int t = omp_get_thread_num();
+            if (first_core + t < num_cores) {
+                cpu_set_t cpuset;
+                CPU_ZERO(&cpuset);
+                CPU_SET(first_core + t, &cpuset);
+                pid_t tid = syscall(SYS_gettid);
+                sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+            }
+            CoroExecutor* ex = layout > 0 ? execs[t % execs.size()] : nullptr;
+            std::vector<CommOp*> ops;
+            #pragma omp barrier
+            #pragma omp single
+            t0 = omp_get_wtime();
+            for (int r = 0; r < rounds; r++) {
+                bool pending = false;
+                pthread_t send_thread;
+                for (int i = 0; i < burst; i++) {
+                    char* message = (char*)malloc(bytes);
+                    memset(message, 'A', bytes);
+                    double l0 = omp_get_wtime();
+                    if (layout == 0) {
+                        int core = std::min(t, num_cores - 1);
+                        bool started = launch_send(fds[t], core, message, bytes, nullptr, &stats[t], &send_thread,
+                                                   pending ? &send_thread : nullptr);
+                        pending = pending || started;
+                    } else if (layout == 1) {
+                        ops.push_back(coro_send(ex, fds[t], message, bytes, &stats[t]));
+                    } else {
+                        ops.push_back(coro_collective(ex, &groups[r], fds[t], message, bytes, &stats[t]));
+                    }
+                    launch[t] += omp_get_wtime() - l0;
+                }
+                double w0 = omp_get_wtime();
+                if (pending) pthread_join(send_thread, nullptr);
+                for (CommOp* op : ops) comm_wait(op);
+                ops.clear();
+                wait[t] += omp_get_wtime() - w0;
+            }
+        }
+        double wall = omp_get_wtime() - t0;
+        double cpu = 0.0, launch_sum = 0.0, wait_sum = 0.0;
+        std::vector<double> latency;
+        for (int t = 0; t < threads; t++) {
+            cpu += stats[t].cpu_time;
+            launch_sum += launch[t];
+            wait_sum += wait[t];
+            latency.insert(latency.end(), stats[t].latency_us.begin(), stats[t].latency_us.end());
+        }
+        for (CoroExecutor* ex : execs) {
+            coro_stop(ex);
+            cpu += ex->cpu_time;
+            delete ex;
+        }
+        double msgs = (double)threads * rounds * burst;
+        printf("%-22s %10.0f %12.2f %12.1f %10.1f %10.1f %12.2f\n", names[layout], msgs / wall, launch_sum / msgs * 1e6,
+               wait_sum / ((double)threads * rounds) * 1e6, percentile(latency, 50), percentile(latency, 99),
+               cpu / msgs * 1e6);
+        for (int fd : fds) close(fd);
+    }
+}
+#endif
+
+// Row partitioning (--partition=...). Each compute thread gets a contiguous band of rows in
+// proportion to its core's capacity instead of an equal duty, so a slower core (an efficiency
+// core, or one that also carries sends) does not hold the others at the barrier.
+enum PartitionMode {
+    PARTITION_EQUAL = 0,      // The original equal duty.
+    PARTITION_SYSFS = 1,      // cpu_capacity (Arm big.LITTLE), else cpuinfo_max_freq (hybrid x86).
+    PARTITION_MEASURED = 2,   // Rows per second measured over the 10 warm-up iterations, then fixed.
+    PARTITION_ADAPTIVE = 3,   // Re-measured after every iteration.
+    NUM_PARTITIONS
+};
+const char* partition_names[NUM_PARTITIONS] = {"equal", "sysfs", "measured", "adaptive"};
+
+#define MAX_PARTITION_THREADS 64
+
+struct RowPartition {
+    int mode;
+    int threads;
+    int rows;
+    int align;                 // Inner bounds are multiples of this (the kernel's tile rows).
+    double alpha;              // Weight of the newest iteration in the measured capacity.
+    bool measured;             // capacity[] holds rows/s rather than sysfs units.
+    double capacity[MAX_PARTITION_THREADS];
+    int bounds[MAX_PARTITION_THREADS + 1];   // Thread t computes rows [bounds[t], bounds[t + 1]).
+    int repartitions;          // Updates that moved at least one bound.
+    // Balance over the measured iterations, each thread accumulating its own slot.
+    double busy[MAX_PARTITION_THREADS];
+    double idle[MAX_PARTITION_THREADS];   // Time spent waiting for the slowest thread.
+    int samples;
+};
+
+// Capacity the kernel reports for a core; 1 when it reports none.
+double sysfs_core_capacity(int core) {
+    std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(core);
+    double cap = std::atof(read_first_line((base + "/cpu_capacity").c_str()).c_str());
+    if (cap <= 0) cap = std::atof(read_first_line((base + "/cpufreq/cpuinfo_max_freq").c_str()).c_str());
+    return cap > 0 ? cap : 1.0;
+}
+
+// Recomputes the bounds from the capacities; returns true if any bound moved.
+bool partition_rows(RowPartition* p) {
+    double total = 0.0;
+    for (int t = 0; t < p->threads; t++) total += p->capacity[t];
+    bool moved = false;
+    double acc = 0.0;
+    for (int t = 1; t < p->threads; t++) {
+        acc += p->capacity[t - 1];
+        int b = (int)(p->rows * acc / total / p->align + 0.5) * p->align;
+        b = std::min(std::max(b, p->bounds[t - 1]), p->rows);
+        moved = moved || b != p->bounds[t];
+        p->bounds[t] = b;
+    }
+    return moved;
+}
+
+// cores[t] is the core of compute thread t (-1 if it is not pinned).
+void partition_init(RowPartition* p, int mode, const std::vector<int>& cores, int rows, int align, double alpha) {
+    memset(p, 0, sizeof(*p));
+    p->mode = mode;
+    p->threads = std::min((int)cores.size(), MAX_PARTITION_THREADS);
+    p->rows = rows;
+    p->align = std::max(align, 1);
+    p->alpha = std::min(std::max(alpha, 0.01), 1.0);
+    int duty = rows / p->threads;
+    for (int t = 0; t < p->threads; t++) {
+        p->bounds[t] = t * duty;
+        p->capacity[t] = mode == PARTITION_EQUAL ? 1.0 : sysfs_core_capacity(cores[t] < 0 ? 0 : cores[t]);
+    }
+    p->bounds[p->threads] = rows;
+    if (mode != PARTITION_EQUAL) partition_rows(p);
+}
+
+// After iteration iter, with every thread's matmul time in times[]: folds the rates into the
+// capacities and re-partitions (measured: warm-up only; adaptive: always). One thread calls
+// this while the others wait, so the new bounds apply from the next iteration.
+void partition_update(RowPartition* p, int iter, const double* times) {
+    if (p->mode != PARTITION_ADAPTIVE && (p->mode != PARTITION_MEASURED || iter >= 10)) return;
+    for (int t = 0; t < p->threads; t++) {
+        int rows = p->bounds[t + 1] - p->bounds[t];
+        if (rows == 0 || times[t] <= 0) continue;
+        double rate = rows / times[t];
+        p->capacity[t] = p->measured ? (1.0 - p->alpha) * p->capacity[t] + p->alpha * rate : rate;
+    }
+    p->measured = true;
+    if (partition_rows(p)) p->repartitions++;
+}
+
+void print_partition_report(const RowPartition* p, const std::vector<int>& cores, double avg_iter_time) {
+    double cap_max = 0.0, busy_sum = 0.0, busy_max = 0.0, idle_sum = 0.0;
+    for (int t = 0; t < p->threads; t++) {
+        cap_max = std::max(cap_max, p->capacity[t]);
+        busy_sum += p->busy[t];
+        busy_max = std::max(busy_max, p->busy[t]);
+        idle_sum += p->idle[t];
+    }
+    printf("Row partition (%s%s):\n", partition_names[p->mode],
+           p->mode == PARTITION_ADAPTIVE ? (", " + std::to_string(p->repartitions) + " repartitions").c_str() : "");
+    printf("%8s %6s %8s %8s %10s %12s %12s\n", "thread", "core", "rows", "share", "capacity", "busy us", "idle us");
+    for (int t = 0; t < p->threads; t++) {
+        int rows = p->bounds[t + 1] - p->bounds[t];
+        printf("%8d %6d %8d %7.1f%% %10.2f %12.1f %12.1f\n", t, cores[t], rows, 100.0 * rows / p->rows,
+               p->capacity[t] / cap_max, p->samples ? p->busy[t] / p->samples * 1e6 : 0.0,
+               p->samples ? p->idle[t] / p->samples * 1e6 : 0.0);
+    }
+    if (p->samples && busy_sum > 0) {
+        printf("balance: slowest / mean thread %.3f, %.1f%% of thread time idle at the barrier, %.1f us per iteration\n",
+               busy_max / (busy_sum / p->threads), 100.0 * idle_sum / (busy_sum + idle_sum), avg_iter_time * 1e6);
+    }
+}
+
+// Synchronization used at the end of every iteration (--barrier=...).
+enum BarrierMode {
+    BARRIER_OMP = 0,    // #pragma omp barrier + single + barrier (original).
+    BARRIER_SPIN = 1,   // SpinBarrier, pure spinning.
+    BARRIER_FUTEX = 2,  // SpinBarrier, sleeping on a futex after spin_limit polls.
+};
+#define MAX_BARRIER_THREADS 64
+#define BARRIER_VALUES 2
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// One thread's private barrier state, alone on its cache line.
+struct alignas(64) BarrierSlot {
+    double value[BARRIER_VALUES];   // Values contributed to the max-reduction.
+    int local_sense;
+    unsigned long waits;            // Episodes in which this thread waited for others.
+    double wake_ns_sum;             // Release-to-wakeup latency, summed over those waits.
+    double wake_ns_max;
+};
+
+// Sense-reversing centralized barrier. The arrival counter, the release word and each
+// thread's slot sit on separate cache lines. The last thread to arrive reduces every
+// slot's values to their max and publishes it before flipping the sense, so the
+// iteration-max computation needs no extra synchronization.
+struct SpinBarrier {
+    alignas(64) std::atomic<int> count;
+    alignas(64) std::atomic<int> sense;      // Release word; also the futex word.
+    std::atomic<int> sleepers;               // Threads blocked in FUTEX_WAIT.
+    alignas(64) double result[BARRIER_VALUES];
+    double release_ns;                       // now_ns() when the last thread released.
+    int num_threads;
+    int spin_limit;                          // Polls before sleeping; < 0 never sleeps.
+    BarrierSlot slots[MAX_BARRIER_THREADS];
+};
+
+void barrier_init(SpinBarrier* b, int num_threads, int spin_limit) {
+    b->count.store(num_threads);
+    b->sense.store(0);
+    b->sleepers.store(0);
+    b->num_threads = num_threads;
+    b->spin_limit = spin_limit;
+    for (int t = 0; t < num_threads; t++) {
+        b->slots[t] = BarrierSlot();
+    }
+}
+
+// Waits until all threads arrive; returns in out[] the max of each value over all threads.
+void barrier_arrive_max(SpinBarrier* b, int thread_id, const double* values, int num_values, double* out) {
+    BarrierSlot& slot = b->slots[thread_id];
+    for (int v = 0; v < num_values; v++) slot.value[v] = values[v];
+    int my_sense = !slot.local_sense;
+    slot.local_sense = my_sense;
+
+    if (b->count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        for (int v = 0; v < num_values; v++) {
+            double m = b->slots[0].value[v];
+            for (int t = 1; t < b->num_threads; t++) m = std::max(m, b->slots[t].value[v]);
+            b->result[v] = m;
+        }
+        b->count.store(b->num_threads, std::memory_order_relaxed);
+        b->release_ns = now_ns();
+        b->sense.store(my_sense, std::memory_order_seq_cst);
+        if (b->spin_limit >= 0 && b->sleepers.load(std::memory_order_seq_cst) > 0) {
+            syscall(SYS_futex, (int*)&b->sense, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        }
+    } else {
+        int spins = 0;
+        while (b->sense.load(std::memory_order_acquire) != my_sense) {
+            if (b->spin_limit >= 0 && ++spins > b->spin_limit) {
+                b->sleepers.fetch_add(1, std::memory_order_seq_cst);
+                syscall(SYS_futex, (int*)&b->sense, FUTEX_WAIT_PRIVATE, !my_sense, nullptr, nullptr, 0);
+                b->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+            } else {
+                _mm_pause();
+            }
+        }
+        double wake_ns = now_ns() - b->release_ns;
+        slot.waits++;
+        slot.wake_ns_sum += wake_ns;
+        slot.wake_ns_max = std::max(slot.wake_ns_max, wake_ns);
+    }
+    for (int v = 0; v < num_values; v++) out[v] = b->result[v];
+}
+
+// Size of the last-level cache of cpu0, from sysfs; 32 MB if unknown.
+size_t llc_size_bytes() {
+    size_t size = 32u << 20;
+    for (int index = 3; index >= 2; index--) {
+        std::string path = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/size";
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) continue;
+        char unit = 0;
+        unsigned long value = 0;
+        int n = fscanf(f, "%lu%c", &value, &unit);
+        fclose(f);
+        if (n >= 1 && value > 0) {
+            size = value * (unit == 'K' ? 1024 : unit == 'M' ? 1024 * 1024 : 1);
+            break;
+        }
+    }
+    return size;
+}
+
+// Roofline calibration (--calibrate=1): STREAM-style bandwidth and peak compute probes run
+// on the same cores as the matmul threads, before the benchmark starts.
+struct RooflineCalib {
+    // GB/s; [0] = one core, [1] = all cores.
+    double copy[2], triad[2], copy_nt[2], triad_nt[2];
+    double cache_triad[2];     // Triad over arrays sized to stay in the LLC.
+    double fma_gflops[2];      // Peak fp32 FMA throughput.
+    double int8_gops[2];       // Peak int8 dot-product throughput (2 ops per multiply-add).
+    const char* fma_isa;
+    const char* int8_isa;
+};
+
+void stream_copy(const float* a, float* c, size_t n) {
+    for (size_t i = 0; i < n; i++) c[i] = a[i];
+}
+
+void stream_triad(float* a, const float* b, const float* c, float scalar, size_t n) {
+    for (size_t i = 0; i < n; i++) a[i] = b[i] + scalar * c[i];
+}
+
+__attribute__((target("avx")))
+void stream_copy_nt(const float* a, float* c, size_t n) {
+    for (size_t i = 0; i < n; i += 8) _mm256_stream_ps(c + i, _mm256_load_ps(a + i));
+    _mm_sfence();
+}
+
+__attribute__((target("avx")))
+void stream_triad_nt(float* a, const float* b, const float* c, float scalar, size_t n) {
+    __m256 s = _mm256_set1_ps(scalar);
+    for (size_t i = 0; i < n; i += 8) {
+        _mm256_stream_ps(a + i, _mm256_add_ps(_mm256_load_ps(b + i), _mm256_mul_ps(s, _mm256_load_ps(c + i))));
+    }
+    _mm_sfence();
+}
+
+// Peak-throughput loops: 12 independent accumulator chains hide the FMA/dot latency.
+// Each returns the number of floating-point (or integer) operations performed.
+__attribute__((target("avx512f")))
+double fma_peak_avx512(long iters, float* sink) {
+    __m512 acc[12];
+    for (int j = 0; j < 12; j++) acc[j] = _mm512_set1_ps(j * 0.001f);
+    __m512 m = _mm512_set1_ps(0.999999f), a = _mm512_set1_ps(1e-7f);
+    for (long it = 0; it < iters; it++) {
+        for (int j = 0; j < 12; j++) acc[j] = _mm512_fmadd_ps(acc[j], m, a);
+    }
+    for (int j = 1; j < 12; j++) acc[0] = _mm512_add_ps(acc[0], acc[j]);
+    *sink = _mm512_reduce_add_ps(acc[0]);
+    return iters * 12.0 * 16 * 2;
+}
+
+__attribute__((target("avx2,fma")))
+double fma_peak_avx2(long iters, float* sink) {
+    __m256 acc[12];
+    for (int j = 0; j < 12; j++) acc[j] = _mm256_set1_ps(j * 0.001f);
+    __m256 m = _mm256_set1_ps(0.999999f), a = _mm256_set1_ps(1e-7f);
+    for (long it = 0; it < iters; it++) {
+        for (int j = 0; j < 12; j++) acc[j] = _mm256_fmadd_ps(acc[j], m, a);
+    }
+    for (int j = 1; j < 12; j++) acc[0] = _mm256_add_ps(acc[0], acc[j]);
+    float out[8];
+    _mm256_storeu_ps(out, acc[0]);
+    *sink = out[0];
+    return iters * 12.0 * 8 * 2;
+}
+
+double fma_peak_scalar(long iters, float* sink) {
+    float acc[12];
+    for (int j = 0; j < 12; j++) acc[j] = j * 0.001f;
+    for (long it = 0; it < iters; it++) {
+        for (int j = 0; j < 12; j++) acc[j] = acc[j] * 0.999999f + 1e-7f;
+    }
+    *sink = acc[0] + acc[11];
+    return iters * 12.0 * 2;
+}
+
+__attribute__((target("avx512vnni,avx512f")))
+double int8_peak_vnni(long iters, float* sink) {
+    __m512i acc[12];
+    for (int j = 0; j < 12; j++) acc[j] = _mm512_set1_epi32(j);
+    __m512i a = _mm512_set1_epi8(3), b = _mm512_set1_epi8(-2);
+    for (long it = 0; it < iters; it++) {
+        for (int j = 0; j < 12; j++) acc[j] = _mm512_dpbusd_epi32(acc[j], a, b);
+    }
+    for (int j = 1; j < 12; j++) acc[0] = _mm512_add_epi32(acc[0], acc[j]);
+    *sink = (float)_mm512_reduce_add_epi32(acc[0]);
+    return iters * 12.0 * 64 * 2;
+}
+
+__attribute__((target("avx2")))
+double int8_peak_avx2(long iters, float* sink) {
+    __m256i acc[12];
+    for (int j = 0; j < 12; j++) acc[j] = _mm256_set1_epi32(j);
+    __m256i a = _mm256_set1_epi8(3), b = _mm256_set1_epi8(-2), ones = _mm256_set1_epi16(1);
+    for (long it = 0; it < iters; it++) {
+        for (int j = 0; j < 12; j++) {
+            acc[j] = _mm256_add_epi32(acc[j], _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), ones));
+        }
+    }
+    for (int j = 1; j < 12; j++) acc[0] = _mm256_add_epi32(acc[0], acc[j]);
+    *sink = (float)_mm256_extract_epi32(acc[0], 0);
+    return iters * 12.0 * 32 * 2;
+}
+
+double int8_peak_scalar(long iters, float* sink) {
+    int32_t acc[12];
+    for (int j = 0; j < 12; j++) acc[j] = j;
+    volatile int8_t va = 3, vb = -2;
+    int8_t a = va, b = vb;
+    for (long it = 0; it < iters; it++) {
+        for (int j = 0; j < 12; j++) acc[j] += (int32_t)a * (int32_t)(b + j);
+    }
+    *sink = (float)(acc[0] + acc[11]);
+    return iters * 12.0 * 2;
+}
+
+// Runs every probe on `threads` threads pinned to first_core, first_core + 1, ...
+// Bandwidth arrays total array_bytes each (split across threads); the best of 5 reps counts.
+void roofline_probe(int threads, int first_core, size_t array_bytes, size_t llc_bytes, int slot, RooflineCalib* rc) {
+    static const bool has_avx512 = __builtin_cpu_supports("avx512f");
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    static const bool has_vnni = __builtin_cpu_supports("avx512vnni");
+    rc->fma_isa = has_avx512 ? "avx512" : has_avx2 ? "avx2+fma" : "scalar";
+    rc->int8_isa = has_vnni ? "avx512-vnni" : has_avx2 ? "avx2" : "scalar";
+
+    double best[5] = {1e300, 1e300, 1e300, 1e300, 1e300};
+    double fma_time = 0.0, int8_time = 0.0, fma_ops = 0.0, int8_ops = 0.0;
+    const size_t n = std::max(array_bytes / sizeof(float) / threads / 8 * 8, (size_t)8);
+    const size_t n_cache = std::max(llc_bytes / 4 / 3 / sizeof(float) / threads / 8 * 8, (size_t)8);
+
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = omp_get_thread_num();
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(first_core + t, &cpuset);
+        pid_t tid = syscall(SYS_gettid);
+        sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+
+        float* a = (float*)aligned_alloc(64, n * sizeof(float));
+        float* b = (float*)aligned_alloc(64, n * sizeof(float));
+        float* c = (float*)aligned_alloc(64, n * sizeof(float));
+        for (size_t i = 0; i < n; i++) {
+            a[i] = 1.0f;
+            b[i] = 2.0f;
+            c[i] = 0.5f;
+        }
+        for (int rep = 0; rep < 5; rep++) {
+            for (int k = 0; k < 5; k++) {
+                size_t len = k == 4 ? n_cache : n;
+                #pragma omp barrier
+                double t0 = omp_get_wtime();
+                switch (k) {
+                    case 0: stream_copy(a, c, len); break;
+                    case 1: stream_triad(a, b, c, 3.0f, len); break;
+                    case 2: stream_copy_nt(a, c, len); break;
+                    case 3: stream_triad_nt(a, b, c, 3.0f, len); break;
+                    case 4:
+                        // LLC-resident: repeat the small triad so the timing is not too short.
+                        for (int r = 0; r < 8; r++) stream_triad(a, b, c, 3.0f, len);
+                        break;
+                }
+                #pragma omp barrier
+                if (t == 0) best[k] = std::min(best[k], omp_get_wtime() - t0);
+            }
+        }
+        free(a);
+        free(b);
+        free(c);
+
+        float sink;
+        const long iters = 4000000;
+        #pragma omp barrier
+        double t0 = omp_get_wtime();
+        double ops = has_avx512 ? fma_peak_avx512(iters, &sink) : has_avx2 ? fma_peak_avx2(iters, &sink)
+                                                                            : fma_peak_scalar(iters, &sink);
+        #pragma omp barrier
+        if (t == 0) {
+            fma_time = omp_get_wtime() - t0;
+            fma_ops = ops * threads;
+        }
+        #pragma omp barrier
+        t0 = omp_get_wtime();
+        ops = has_vnni ? int8_peak_vnni(iters, &sink) : has_avx2 ? int8_peak_avx2(iters, &sink)
+                                                                   : int8_peak_scalar(iters, &sink);
+        #pragma omp barrier
+        if (t == 0) {
+            int8_time = omp_get_wtime() - t0;
+            int8_ops = ops * threads;
+        }
+        if (sink == 12345.0f) printf(" ");
+    }
+
+    double total = (double)n * threads * sizeof(float);
+    rc->copy[slot] = 2 * total / best[0] * 1e-9;
+    rc->triad[slot] = 3 * total / best[1] * 1e-9;
+    rc->copy_nt[slot] = 2 * total / best[2] * 1e-9;
+    rc->triad_nt[slot] = 3 * total / best[3] * 1e-9;
+    rc->cache_triad[slot] = 8 * 3 * (double)n_cache * threads * sizeof(float) / best[4] * 1e-9;
+    rc->fma_gflops[slot] = fma_ops / fma_time * 1e-9;
+    rc->int8_gops[slot] = int8_ops / int8_time * 1e-9;
+}
+
+void print_roofline_calib(const RooflineCalib& rc, int threads, int first_core) {
+    printf("Roofline calibration on cores %d-%d (1 core / %d cores):\n", first_core, first_core + threads - 1, threads);
+    printf("  copy          %8.1f / %8.1f GB/s\n", rc.copy[0], rc.copy[1]);
+    printf("  triad         %8.1f / %8.1f GB/s\n", rc.triad[0], rc.triad[1]);
+    printf("  copy (NT)     %8.1f / %8.1f GB/s\n", rc.copy_nt[0], rc.copy_nt[1]);
+    printf("  triad (NT)    %8.1f / %8.1f GB/s\n", rc.triad_nt[0], rc.triad_nt[1]);
+    printf("  triad (LLC)   %8.1f / %8.1f GB/s\n", rc.cache_triad[0], rc.cache_triad[1]);
+    printf("  fp32 FMA      %8.1f / %8.1f GFLOP/s (%s)\n", rc.fma_gflops[0], rc.fma_gflops[1], rc.fma_isa);
+    printf("  int8 dot      %8.1f / %8.1f GOP/s (%s)\n", rc.int8_gops[0], rc.int8_gops[1], rc.int8_isa);
+}
+
+// Prints a kernel's achieved throughput against the roofline bound for its arithmetic
+// intensity: min(peak compute, AI * bandwidth), where the bandwidth roof is the LLC triad
+// if the kernel's footprint fits in the LLC and the DRAM triad otherwise.
+void print_roofline_result(const char* kernel, double ops, double bytes, double seconds, double peak_gops,
+                           const RooflineCalib& rc, size_t llc_bytes) {
+    bool in_cache = bytes <= llc_bytes;
+    double bandwidth = in_cache ? rc.cache_triad[1] : std::max(rc.triad[1], rc.triad_nt[1]);
+    double ai = ops / bytes;
+    double bound = std::min(peak_gops, ai * bandwidth);
+    double achieved = ops / seconds * 1e-9;
+    printf("Roofline %s: AI %.3f op/B, %.2f GOP/s achieved, bound %.2f GOP/s (%s-bound, %s roof) = %.1f%% of roofline\n",
+           kernel, ai, achieved, bound, bound == peak_gops ? "compute" : "memory", in_cache ? "LLC" : "DRAM",
+           100.0 * achieved / bound);
+}
+
+// Per-core frequency telemetry (--freq=1). A sampler thread reads every monitored core's
+// scaling_cur_freq, APERF/MPERF counters (perf msr PMU, else /dev/cpu/N/msr) and thermal
+// throttle count each period, and files the sample under the iteration that is running.
+enum FreqCounterSource {
+    FREQ_COUNTERS_NONE,
+    FREQ_COUNTERS_PERF,
+    FREQ_COUNTERS_MSR
+};
+
+const char* freq_counter_names[] = {"unavailable", "perf msr PMU", "/dev/cpu/N/msr"};
+
+#define MSR_IA32_MPERF 0xE7
+#define MSR_IA32_APERF 0xE8
+
+struct FreqCore {
+    int core;
+    int cur_freq_fd;        // scaling_cur_freq, or -1 (then /proc/cpuinfo "cpu MHz" is used).
+    int throttle_fd;        // thermal_throttle/core_throttle_count, or -1.
+    int aperf_fd;           // perf event, or the msr device for both counters.
+    int mperf_fd;
+    uint64_t aperf;         // Last counter readings.
+    uint64_t mperf;
+    bool have_counters;
+    long throttles;         // Last throttle count, -1 before the first reading.
+};
+
+// Samples of one core during one iteration.
+struct FreqBucket {
+    double khz_sum;
+    double khz_min;
+    int samples;
+    uint64_t aperf;
+    uint64_t mperf;
+    long throttles;
+};
+
+struct FreqSampler {
+    std::vector<FreqCore> cores;
+    int counters;               // FreqCounterSource.
+    bool cpuinfo_freq;          // No scaling_cur_freq; current MHz comes from /proc/cpuinfo.
+    double base_khz;            // MPERF rate: effective frequency = base * dAPERF / dMPERF.
+    double period_us;
+    int core_id;                // Core the sampler runs on.
+    int num_iter;
+    std::vector<FreqBucket> buckets;    // num_iter x cores.
+    std::atomic<int> iter;      // Running iteration, advanced by the thread that closes each one.
+    std::atomic<bool> stop;
+    long samples;
+    pthread_t thread;
+};
+
+long read_long_fd(int fd) {
+    char buf[64];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    return std::atol(buf);
+}
+
+// Opens the "aperf" or "mperf" event of the perf msr PMU on one core (needs CAP_PERFMON or
+// perf_event_paranoid <= 0).
+int open_perf_msr_event(const char* name, int core) {
+    int type = std::atoi(read_first_line("/sys/bus/event_source/devices/msr/type").c_str());
+    std::string event = read_first_line((std::string("/sys/bus/event_source/devices/msr/events/") + name).c_str());
+    size_t eq = event.find('=');
+    if (type <= 0 || eq == std::string::npos) return -1;
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = strtoull(event.c_str() + eq + 1, nullptr, 0);
+    return syscall(SYS_perf_event_open, &attr, -1, core, -1, 0);
+}
+
+bool read_freq_counters(int source, const FreqCore& c, uint64_t* aperf, uint64_t* mperf) {
+    if (source == FREQ_COUNTERS_PERF) {
+        return read(c.aperf_fd, aperf, 8) == 8 && read(c.mperf_fd, mperf, 8) == 8;
+    }
+    if (source == FREQ_COUNTERS_MSR) {
+        return pread(c.aperf_fd, aperf, 8, MSR_IA32_APERF) == 8 && pread(c.aperf_fd, mperf, 8, MSR_IA32_MPERF) == 8;
+    }
+    return false;
+}
+
+// "cpu MHz" of every core from /proc/cpuinfo, in kHz (indexed by core).
+void read_cpuinfo_khz(std::vector<double>& khz) {
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    if (!f) return;
+    char line[512];
+    int core = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "processor", 9) == 0) {
+            core = std::atoi(strchr(line, ':') + 1);
+        } else if (strncmp(line, "cpu MHz", 7) == 0 && core >= 0 && core < (int)khz.size()) {
+            khz[core] = std::atof(strchr(line, ':') + 1) * 1000.0;
+        }
+    }
+    fclose(f);
+}
+
+// Opens the sysfs files and counters of every core; the counter source is the first one that
+// works on all cores.
+void freq_open(FreqSampler* fs, const std::vector<int>& cores, int num_iter) {
+    fs->counters = FREQ_COUNTERS_NONE;
+    fs->cpuinfo_freq = false;
+    for (int core : cores) {
+        FreqCore c;
+        std::string cpu = "/sys/devices/system/cpu/cpu" + std::to_string(core);
+        c.core = core;
+        c.cur_freq_fd = open((cpu + "/cpufreq/scaling_cur_freq").c_str(), O_RDONLY);
+        c.throttle_fd = open((cpu + "/thermal_throttle/core_throttle_count").c_str(), O_RDONLY);
+        c.aperf_fd = c.mperf_fd = -1;
+        c.aperf = c.mperf = 0;
+        c.have_counters = false;
+        c.throttles = -1;
+        fs->cpuinfo_freq = fs->cpuinfo_freq || c.cur_freq_fd < 0;
+        fs->cores.push_back(c);
+    }
+    for (int source = FREQ_COUNTERS_PERF; source <= FREQ_COUNTERS_MSR && fs->counters == FREQ_COUNTERS_NONE; source++) {
+        bool ok = !fs->cores.empty();
+        for (FreqCore& c : fs->cores) {
+            if (source == FREQ_COUNTERS_PERF) {
+                c.aperf_fd = open_perf_msr_event("aperf", c.core);
+                c.mperf_fd = open_perf_msr_event("mperf", c.core);
+            } else {
+                c.aperf_fd = open(("/dev/cpu/" + std::to_string(c.core) + "/msr").c_str(), O_RDONLY);
+            }
+            uint64_t a, m;
+            ok = ok && c.aperf_fd >= 0 && read_freq_counters(source, c, &a, &m);
+        }
+        if (ok) {
+            fs->counters = source;
+            break;
+        }
+        for (FreqCore& c : fs->cores) {
+            if (c.aperf_fd >= 0) close(c.aperf_fd);
+            if (c.mperf_fd >= 0) close(c.mperf_fd);
+            c.aperf_fd = c.mperf_fd = -1;
+        }
+    }
+    // MPERF ticks at the base (TSC) frequency.
+    fs->base_khz = std::atof(read_first_line("/sys/devices/system/cpu/cpu0/cpufreq/base_frequency").c_str());
+    if (fs->base_khz <= 0) {
+        fs->base_khz = std::atof(read_first_line("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq").c_str());
+    }
+    fs->num_iter = num_iter;
+    fs->buckets.assign((size_t)num_iter * fs->cores.size(), FreqBucket{0.0, 0.0, 0, 0, 0, 0});
+    fs->iter.store(0);
+    fs->stop.store(false);
+    fs->samples = 0;
+}
+
+void* freq_main(void* arg) {
+    FreqSampler* fs = (FreqSampler*) arg;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(fs->core_id, &cpuset);
+    pid_t tid = syscall(SYS_gettid);
+    sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+
+    std::vector<double> cpuinfo_khz(sysconf(_SC_NPROCESSORS_CONF), 0.0);
+    timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!fs->stop.load(std::memory_order_relaxed)) {
+        int it = std::min(fs->iter.load(std::memory_order_relaxed), fs->num_iter - 1);
+        if (fs->cpuinfo_freq) read_cpuinfo_khz(cpuinfo_khz);
+        for (size_t i = 0; i < fs->cores.size(); i++) {
+            FreqCore& c = fs->cores[i];
+            FreqBucket& b = fs->buckets[(size_t)it * fs->cores.size() + i];
+            double khz = c.cur_freq_fd >= 0 ? (double)read_long_fd(c.cur_freq_fd) : cpuinfo_khz[c.core];
+            if (khz > 0) {
+                b.khz_min = b.samples ? std::min(b.khz_min, khz) : khz;
+                b.khz_sum += khz;
+                b.samples++;
+            }
+            uint64_t aperf, mperf;
+            if (read_freq_counters(fs->counters, c, &aperf, &mperf)) {
+                if (c.have_counters) {
+                    b.aperf += aperf - c.aperf;
+                    b.mperf += mperf - c.mperf;
+                }
+                c.aperf = aperf;
+                c.mperf = mperf;
+                c.have_counters = true;
+            }
+            long throttles = c.throttle_fd >= 0 ? read_long_fd(c.throttle_fd) : -1;
+            if (throttles >= 0) {
+                if (c.throttles >= 0) b.throttles += throttles - c.throttles;
+                c.throttles = throttles;
+            }
+        }
+        fs->samples++;
+        long ns = next.tv_nsec + (long)(fs->period_us * 1000);
+        next.tv_sec += ns / 1000000000;
+        next.tv_nsec = ns % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+    }
+    return nullptr;
+}
+
+double pearson(const std::vector<double>& x, const std::vector<double>& y) {
+    size_t n = std::min(x.size(), y.size());
+    if (n < 2) return 0.0;
+    double mx = 0.0, my = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        mx += x[i];
+        my += y[i];
+    }
+    mx /= n;
+    my /= n;
+    double sxy = 0.0, sxx = 0.0, syy = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        sxy += (x[i] - mx) * (y[i] - my);
+        sxx += (x[i] - mx) * (x[i] - mx);
+        syy += (y[i] - my) * (y[i] - my);
+    }
+    return sxx > 0 && syy > 0 ? sxy / std::sqrt(sxx * syy) : 0.0;
+}
+
+// Effective kHz of one bucket from APERF/MPERF (the ratio itself, x1000, if the base is
+// unknown), or its mean current kHz when there are no counters.
+double freq_bucket_khz(const FreqSampler* fs, const FreqBucket& b) {
+    if (fs->counters != FREQ_COUNTERS_NONE && b.mperf > 0) {
+        double ratio = (double)b.aperf / b.mperf;
+        return fs->base_khz > 0 ? ratio * fs->base_khz : ratio * 1000.0;
+    }
+    return b.samples ? b.khz_sum / b.samples : 0.0;
+}
+
+// Per-core averages over the measured iterations (>= 10), then the per-iteration frequency of
+// the compute and send cores and the throttle events correlated with the iteration time.
+void freq_report(const FreqSampler* fs, const std::vector<double>& iter_times, const std::vector<int>& compute,
+                 const char* csv_path) {
+    const size_t n = fs->cores.size();
+    const int first = std::min(10, fs->num_iter - 1);
+    printf("Frequency telemetry: %ld samples every %.0f us on core %d; current MHz from %s; APERF/MPERF %s",
+           fs->samples, fs->period_us, fs->core_id, fs->cpuinfo_freq ? "/proc/cpuinfo" : "scaling_cur_freq",
+           freq_counter_names[fs->counters]);
+    if (fs->counters != FREQ_COUNTERS_NONE) {
+        if (fs->base_khz > 0) {
+            printf(" (base %.0f MHz)", fs->base_khz / 1000);
+        } else {
+            printf(" (base unknown: effective column is APERF/MPERF x 1000)");
+        }
+    }
+    printf("\n  core  role     cur MHz avg / min   effective MHz   throttles\n");
+    for (size_t i = 0; i < n; i++) {
+        FreqBucket total = {0.0, 0.0, 0, 0, 0, 0};
+        for (int it = first; it < fs->num_iter; it++) {
+            const FreqBucket& b = fs->buckets[(size_t)it * n + i];
+            if (b.samples) total.khz_min = total.samples ? std::min(total.khz_min, b.khz_min) : b.khz_min;
+            total.khz_sum += b.khz_sum;
+            total.samples += b.samples;
+            total.aperf += b.aperf;
+            total.mperf += b.mperf;
+            total.throttles += b.throttles;
+        }
+        bool is_compute = std::find(compute.begin(), compute.end(), fs->cores[i].core) != compute.end();
+        char effective[32] = "n/a";
+        if (fs->counters != FREQ_COUNTERS_NONE) snprintf(effective, sizeof(effective), "%.0f", freq_bucket_khz(fs, total) / 1000);
+        printf("  %4d  %-7s  %8.0f / %-8.0f  %13s   %9ld\n", fs->cores[i].core, is_compute ? "compute" : "send",
+               total.samples ? total.khz_sum / total.samples / 1000 : 0.0, total.khz_min / 1000, effective,
+               total.throttles);
+    }
+
+    // Per measured iteration: mean MHz over the compute cores and over the other cores (only
+    // iterations that got a sample count), and the throttle events of all cores.
+    std::vector<double> times, throttles, compute_times, compute_mhz, send_times, send_mhz;
+    FILE* csv = csv_path ? fopen(csv_path, "w") : nullptr;
+    if (csv) {
+        fprintf(csv, "iter,time_us");
+        for (size_t i = 0; i < n; i++) fprintf(csv, ",core%d_mhz,core%d_throttles", fs->cores[i].core, fs->cores[i].core);
+        fprintf(csv, "\n");
+    }
+    for (int it = first; it < fs->num_iter; it++) {
+        double csum = 0.0, ssum = 0.0, tsum = 0.0;
+        int cn = 0, sn = 0;
+        if (csv) fprintf(csv, "%d,%.3f", it, iter_times[it] * 1e6);
+        for (size_t i = 0; i < n; i++) {
+            const FreqBucket& b = fs->buckets[(size_t)it * n + i];
+            double khz = freq_bucket_khz(fs, b);
+            if (csv) fprintf(csv, ",%.0f,%ld", khz / 1000, b.throttles);
+            tsum += b.throttles;
+            if (khz <= 0) continue;
+            if (std::find(compute.begin(), compute.end(), fs->cores[i].core) != compute.end()) {
+                csum += khz;
+                cn++;
+            } else {
+                ssum += khz;
+                sn++;
+            }
+        }
+        if (csv) fprintf(csv, "\n");
+        times.push_back(iter_times[it]);
+        throttles.push_back(tsum);
+        if (cn) {
+            compute_times.push_back(iter_times[it]);
+            compute_mhz.push_back(csum / cn / 1000);
+        }
+        if (sn) {
+            send_times.push_back(iter_times[it]);
+            send_mhz.push_back(ssum / sn / 1000);
+        }
+    }
+    if (csv) {
+        fclose(csv);
+        printf("  per-iteration samples written to %s\n", csv_path);
+    }
+    printf("  correlation with iteration time: compute MHz r = %.3f (%zu iterations), send-core MHz r = %.3f (%zu), "
+           "throttles r = %.3f\n", pearson(compute_times, compute_mhz), compute_mhz.size(), pearson(send_times, send_mhz),
+           send_mhz.size(), pearson(times, throttles));
+
+    // Frequencies during the slowest tenth of the iterations against the rest.
+    std::vector<double> sorted = times;
+    std::sort(sorted.begin(), sorted.end());
+    double cut = sorted.empty() ? 0.0 : sorted[sorted.size() * 9 / 10];
+    auto split_mean = [cut](const std::vector<double>& t, const std::vector<double>& v, bool slow) {
+        double sum = 0.0;
+        int count = 0;
+        for (size_t i = 0; i < t.size(); i++) {
+            if ((t[i] >= cut) == slow) {
+                sum += v[i];
+                count++;
+            }
+        }
+        return count ? sum / count : 0.0;
+    };
+    printf("  slowest 10%% of iterations: compute %.0f MHz, send cores %.0f MHz (rest: %.0f / %.0f MHz)\n",
+           split_mean(compute_times, compute_mhz, true), split_mean(send_times, send_mhz, true),
+           split_mean(compute_times, compute_mhz, false), split_mean(send_times, send_mhz, false));
+}
+
+// Kernel autotuning (--tune=1). The tuned matmul path is a family of tile kernels that differ
+// in tile height, k-unroll and number of independent accumulators per row; together with the
+// software prefetch distance and the number of matmul threads they form the search space.
+// Winners are cached per (CPU model, dtype, rows, cols) so later runs skip the search.
+typedef int8_t ElemT;   // Element type of A and B.
+typedef int32_t AccT;   // Element type of C and of the accumulators.
+#define KERNEL_DTYPE "int8"
+#define TUNE_REPS 3
+
+// Computes c[r * c_stride] = dot(A row r, b) for rows [row0, row0 + TR). k is unrolled UNROLL
+// times into ACC partial sums per row; prefetch > 0 requests A that many elements ahead.
+// KC > 0 fixes K at compile time (the runtime k_len is then ignored): the row stride becomes a
+// constant and, with KC a multiple of UNROLL, the scalar tail loop disappears.
+template <typename T, typename Acc, int TR, int UNROLL, int ACC, int KC = 0>
+void gemv_tile(const T* A, const T* b, Acc* c, int c_stride, int row0, int k_len, int prefetch) {
+    const int K = KC > 0 ? KC : k_len;
+    const T* rows[TR];
+    Acc acc[TR][ACC];
+    for (int r = 0; r < TR; r++) {
+        rows[r] = A + (size_t)(row0 + r) * K;
+        for (int a = 0; a < ACC; a++) acc[r][a] = 0;
+    }
+    int k = 0;
+    for (; k + UNROLL <= K; k += UNROLL) {
+        if (prefetch > 0) {
+            for (int r = 0; r < TR; r++) __builtin_prefetch(rows[r] + k + prefetch);
+        }
+        for (int u = 0; u < UNROLL; u++) {
+            Acc bv = static_cast<Acc>(b[k + u]);
+            for (int r = 0; r < TR; r++) acc[r][u % ACC] += static_cast<Acc>(rows[r][k + u]) * bv;
+        }
+    }
+    for (; k < K; k++) {
+        for (int r = 0; r < TR; r++) acc[r][0] += static_cast<Acc>(rows[r][k]) * static_cast<Acc>(b[k]);
+    }
+    for (int r = 0; r < TR; r++) {
+        Acc sum = 0;
+        for (int a = 0; a < ACC; a++) sum += acc[r][a];
+        c[(size_t)(row0 + r) * c_stride] = sum;
+    }
+}
+
+typedef void (*TileKernelFn)(const ElemT* A, const ElemT* b, AccT* c, int c_stride, int row0, int K, int prefetch);
+
+struct TileKernel {
+    int K;          // 0 for the generic kernel, else the only K this specialization handles.
+    int tile_rows;
+    int unroll;
+    int accs;
+    TileKernelFn fn;
 };
 
-// Function that runs in a separate pthread to call send() asynchronously.
-void* async_send(void* arg) {
-    AsyncSendParams* params = (AsyncSendParams*) arg;
-    
-    // Set CPU affinity to the desired core (0-3).
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(params->core_id, &cpuset);
-    pid_t tid = syscall(SYS_gettid);
-    if (sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset) != 0) {
-        // Error handling can be added here if needed.
+// The kernel family is the product of these lists: each macro expands F once per value, so
+// another tile height, unroll, accumulator count or specialized K is a one-line change. F is
+// called as F(K, TR, U, ACC), with K = 0 for the generic kernels.
+#define TILE_ACCS(F, K, TR, U) F(K, TR, U, 1), F(K, TR, U, 2), F(K, TR, U, 4)
+#define TILE_UNROLLS(F, K, TR) TILE_ACCS(F, K, TR, 4), TILE_ACCS(F, K, TR, 8), TILE_ACCS(F, K, TR, 16)
+#define TILE_SHAPES(F, K) \
+    TILE_UNROLLS(F, K, 1), TILE_UNROLLS(F, K, 2), TILE_UNROLLS(F, K, 4), TILE_UNROLLS(F, K, 5), TILE_UNROLLS(F, K, 8)
+#define SPECIALIZED_KS(F) TILE_SHAPES(F, 4096), TILE_SHAPES(F, 5120)
+
+#define TILE_KERNEL(K, TR, U, ACC) {K, TR, U, ACC, gemv_tile<ElemT, AccT, TR, U, ACC, K>}
+const TileKernel tile_kernels[] = {TILE_SHAPES(TILE_KERNEL, 0)};
+const int NUM_TILE_KERNELS = sizeof(tile_kernels) / sizeof(tile_kernels[0]);
+
+// Kernels specialized on K for the standard layer widths (--kernel=specialized). Shapes that
+// have no specialization fall back to the generic kernel.
+const TileKernel shape_kernels[] = {SPECIALIZED_KS(TILE_KERNEL)};
+const int NUM_SHAPE_KERNELS = sizeof(shape_kernels) / sizeof(shape_kernels[0]);
+
+// Returns the kernel for this tile shape: the K-specialized one when spec_k matches a
+// precompiled K, else the generic one (nullptr if the tile shape does not exist at all).
+TileKernelFn find_tile_kernel(int tile_rows, int unroll, int accs, int spec_k) {
+    for (int i = 0; spec_k > 0 && i < NUM_SHAPE_KERNELS; i++) {
+        const TileKernel& k = shape_kernels[i];
+        if (k.K == spec_k && k.tile_rows == tile_rows && k.unroll == unroll && k.accs == accs) return k.fn;
     }
-    
-    // Send 1KB data in a blocking call.
-    ssize_t bytes_sent = send(params->sockfd, params->message, params->msg_len, 0);
-    
-    // Free the allocated memory.
-    free(params->message);
-    delete params;
-    pthread_exit(nullptr);
+    for (int i = 0; i < NUM_TILE_KERNELS; i++) {
+        const TileKernel& k = tile_kernels[i];
+        if (k.tile_rows == tile_rows && k.unroll == unroll && k.accs == accs) return k.fn;
+    }
+    return nullptr;
+}
+
+bool has_shape_kernels(int K) {
+    for (int i = 0; i < NUM_SHAPE_KERNELS; i++) {
+        if (shape_kernels[i].K == K) return true;
+    }
+    return false;
+}
+
+struct KernelParams {
+    int tile_rows;
+    int unroll;
+    int accs;
+    int prefetch;   // Software prefetch distance in bytes; 0 disables it.
+    int threads;    // Matmul threads.
+    double us;      // One rows x cols GEMV with these parameters (0 if not measured).
+};
+
+// Times one rows x K GEMV (a single column of B) on p.threads threads pinned to first_core,
+// first_core + 1, ...; each thread takes an equal band of rows. Best of TUNE_REPS, in us.
+// spec_k selects K-specialized kernels as in find_tile_kernel.
+double bench_kernel_params(const KernelParams& p, const ElemT* A, const ElemT* b, AccT* c, int rows, int K,
+                           int first_core, int spec_k) {
+    TileKernelFn tile = find_tile_kernel(p.tile_rows, p.unroll, p.accs, spec_k);
+    TileKernelFn single = find_tile_kernel(1, p.unroll, p.accs, spec_k);
+    int prefetch = p.prefetch / (int)sizeof(ElemT);
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    double best = 1e300;
+
+    #pragma omp parallel num_threads(p.threads)
+    {
+        int t = omp_get_thread_num();
+        int n = omp_get_num_threads();
+        if (first_core + t < num_cores) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(first_core + t, &cpuset);
+            pid_t tid = syscall(SYS_gettid);
+            sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+        }
+        int duty = rows / n;
+        int begin = t * duty;
+        int end = t == n - 1 ? rows : begin + duty;
+        // The first pass only warms the caches and the TLB.
+        for (int rep = 0; rep <= TUNE_REPS; rep++) {
+            #pragma omp barrier
+            double t0 = omp_get_wtime();
+            int i = begin;
+            for (; i + p.tile_rows <= end; i += p.tile_rows) tile(A, b, c, 1, i, K, prefetch);
+            for (; i < end; i++) single(A, b, c, 1, i, K, prefetch);
+            #pragma omp barrier
+            if (t == 0 && rep > 0) best = std::min(best, omp_get_wtime() - t0);
+        }
+    }
+    return best * 1e6;
+}
+
+std::string cpu_model_name() {
+    std::string model = "unknown";
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    if (!f) return model;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "model name", 10) == 0 && strchr(line, ':')) {
+            model = strchr(line, ':') + 1;
+            model.erase(0, model.find_first_not_of(" \t"));
+            model.erase(model.find_last_not_of(" \t\n") + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return model;
+}
+
+// Winners are kept per kernel family too: generic and specialized kernels tune differently.
+std::string tune_cache_key(const std::string& kernel, int rows, int cols) {
+    return cpu_model_name() + "|" KERNEL_DTYPE "|" + kernel + "|" + std::to_string(rows) + "|" + std::to_string(cols);
+}
+
+// Cache file lines are "<key>|tile=.. unroll=.. acc=.. prefetch=.. threads=.. us=..". Entries
+// are appended, so the last line for a key wins. Entries this build cannot run are ignored.
+bool load_tuned_params(const char* path, const std::string& key, int max_threads, KernelParams* out) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    char line[1024];
+    bool found = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key.c_str(), key.size()) != 0 || line[key.size()] != '|') continue;
+        KernelParams p;
+        if (sscanf(line + key.size() + 1, "tile=%d unroll=%d acc=%d prefetch=%d threads=%d us=%lf",
+                   &p.tile_rows, &p.unroll, &p.accs, &p.prefetch, &p.threads, &p.us) == 6 &&
+            find_tile_kernel(p.tile_rows, p.unroll, p.accs, 0) && p.threads >= 1 && p.threads <= max_threads &&
+            p.prefetch >= 0) {
+            *out = p;
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+void save_tuned_params(const char* path, const std::string& key, const KernelParams& p) {
+    FILE* f = fopen(path, "a");
+    if (!f) {
+        std::cerr << "Cannot write tuning cache " << path << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    fprintf(f, "%s|tile=%d unroll=%d acc=%d prefetch=%d threads=%d us=%.2f\n", key.c_str(), p.tile_rows,
+            p.unroll, p.accs, p.prefetch, p.threads, p.us);
+    fclose(f);
+}
+
+// Searches in three stages within budget_ms: kernel shape (tile height, unroll, accumulators)
+// on all threads without prefetch, then the prefetch distance, then fewer threads. The stages
+// get 70/15/15% of the budget, and a candidate that would overrun its stage is not started.
+KernelParams autotune_kernel(const ElemT* A, const ElemT* b, AccT* c, int rows, int K, int first_core,
+                             int max_threads, double budget_ms, int spec_k) {
+    double tune_start = omp_get_wtime();
+    KernelParams best = {5, 4, 1, 0, max_threads, 0.0};   // TILE_ROWS = 5, as in the default loop.
+    best.us = bench_kernel_params(best, A, b, c, rows, K, first_core, spec_k);
+    double baseline_us = best.us;
+    int evaluated = 1;
+    const double stage_end[3] = {0.70, 0.85, 1.0};
+    const int prefetch_bytes[] = {64, 128, 256, 512, 1024, 2048};
+
+    for (int stage = 0; stage < 3; stage++) {
+        std::vector<KernelParams> candidates;
+        if (stage == 0) {
+            for (int i = 0; i < NUM_TILE_KERNELS; i++) {
+                const TileKernel& k = tile_kernels[i];
+                if (k.tile_rows == best.tile_rows && k.unroll == best.unroll && k.accs == best.accs) continue;
+                candidates.push_back({k.tile_rows, k.unroll, k.accs, 0, max_threads, 0.0});
+            }
+        } else if (stage == 1) {
+            for (int pf : prefetch_bytes) {
+                candidates.push_back({best.tile_rows, best.unroll, best.accs, pf, best.threads, 0.0});
+            }
+        } else {
+            for (int th = max_threads - 1; th >= 1; th--) {
+                candidates.push_back({best.tile_rows, best.unroll, best.accs, best.prefetch, th, 0.0});
+            }
+        }
+        double deadline = tune_start + budget_ms * 1e-3 * stage_end[stage];
+        KernelParams stage_best = best;
+        for (KernelParams& cand : candidates) {
+            // Warm-up plus reps, scaled up for candidates running on fewer threads.
+            double estimate = (TUNE_REPS + 1) * best.us * 1e-6 * best.threads / cand.threads;
+            if (omp_get_wtime() + estimate > deadline) break;
+            cand.us = bench_kernel_params(cand, A, b, c, rows, K, first_core, spec_k);
+            evaluated++;
+            if (cand.us < stage_best.us) stage_best = cand;
+        }
+        best = stage_best;
+    }
+
+    printf("Autotune %s %dx%d: %d candidates in %.0f ms -> tile %d, unroll %d, acc %d, prefetch %d B, "
+           "%d threads: %.1f us (tile 5 / unroll 4 / acc 1 baseline %.1f us, %.2fx)\n",
+           KERNEL_DTYPE, rows, K, evaluated, (omp_get_wtime() - tune_start) * 1e3, best.tile_rows, best.unroll,
+           best.accs, best.prefetch, best.threads, best.us, baseline_us, baseline_us / best.us);
+    return best;
+}
+
+// Generic vs K-specialized kernel at every tile height, with the selected unroll, accumulators,
+// prefetch and thread count (--kernel_bench=1).
+void compare_shape_kernels(const KernelParams& kp, const ElemT* A, const ElemT* b, AccT* c, int rows, int K,
+                           int first_core) {
+    if (!has_shape_kernels(K)) {
+        printf("No K=%d kernel specialization; the generic kernel runs\n", K);
+        return;
+    }
+    printf("Shape specialization (%s %dx%d, unroll %d, acc %d, prefetch %d B, %d threads):\n", KERNEL_DTYPE, rows, K,
+           kp.unroll, kp.accs, kp.prefetch, kp.threads);
+    printf("  tile   generic us   specialized us    gain\n");
+    const int tile_heights[] = {1, 2, 4, 5, 8};
+    for (int tr : tile_heights) {
+        KernelParams p = kp;
+        p.tile_rows = tr;
+        double generic_us = bench_kernel_params(p, A, b, c, rows, K, first_core, 0);
+        double spec_us = bench_kernel_params(p, A, b, c, rows, K, first_core, K);
+        printf("  %4d %12.1f %16.1f %7.2fx\n", tr, generic_us, spec_us, generic_us / spec_us);
+    }
+}
+
+// 2:4 structured-sparse A (--sparse=1): every group of four consecutive weights in a row keeps
+// its two largest-magnitude values, and their in-group positions are stored as 2-bit indices,
+// sixteen to a word. A row then streams half the value bytes plus 1/16 of them in indices.
+struct Sparse24 {
+    int rows;
+    int cols;                       // Dense width, a multiple of 32.
+    std::vector<ElemT> values;      // rows x cols / 2.
+    std::vector<uint32_t> index;    // rows x cols / 32; value v uses bits 2 * (v % 16) of word v / 16.
+};
+
+typedef AccT (*Sparse24DotFn)(const Sparse24& sp, int row, const ElemT* b);
+
+// Prunes dense (rows x cols) to 2:4 and compresses it. pruned, if not null, receives the dense
+// matrix with the dropped weights zeroed: the same math as the sparse kernel.
+bool sparse24_from_dense(const ElemT* dense, int rows, int cols, Sparse24* sp, ElemT* pruned) {
+    if (cols % 32 != 0) return false;
+    sp->rows = rows;
+    sp->cols = cols;
+    sp->values.assign((size_t)rows * cols / 2, 0);
+    sp->index.assign((size_t)rows * cols / 32, 0);
+    for (int r = 0; r < rows; r++) {
+        const ElemT* row = dense + (size_t)r * cols;
+        ElemT* vals = &sp->values[(size_t)r * cols / 2];
+        uint32_t* idx = &sp->index[(size_t)r * cols / 32];
+        for (int g = 0; g < cols / 4; g++) {
+            const ElemT* q = row + 4 * g;
+            int first = 0;
+            for (int p = 1; p < 4; p++) {
+                if (std::abs((double)q[p]) > std::abs((double)q[first])) first = p;
+            }
+            int second = first == 0 ? 1 : 0;
+            for (int p = 0; p < 4; p++) {
+                if (p != first && std::abs((double)q[p]) > std::abs((double)q[second])) second = p;
+            }
+            int lo = std::min(first, second), hi = std::max(first, second);
+            vals[2 * g] = q[lo];
+            vals[2 * g + 1] = q[hi];
+            idx[g / 8] |= (uint32_t)(lo | hi << 2) << (4 * (g % 8));
+            if (pruned) {
+                ElemT* out = pruned + (size_t)r * cols + 4 * g;
+                for (int p = 0; p < 4; p++) out[p] = p == lo || p == hi ? q[p] : 0;
+            }
+        }
+    }
+    return true;
+}
+
+AccT sparse24_dot_scalar(const Sparse24& sp, int row, const ElemT* b) {
+    const ElemT* vals = &sp.values[(size_t)row * sp.cols / 2];
+    const uint32_t* idx = &sp.index[(size_t)row * sp.cols / 32];
+    AccT sum = 0;
+    for (int v = 0; v < sp.cols / 2; v++) {
+        int k = v / 2 * 4 + ((idx[v / 16] >> (2 * (v % 16))) & 3);
+        sum += static_cast<AccT>(vals[v]) * static_cast<AccT>(b[k]);
+    }
+    return sum;
+}
+
+// Sixteen kept values (eight groups, 32 dense columns) per step. B bytes are gathered as
+// dwords at byte offsets and sign-extended, so b needs 3 bytes of readable slack at its end.
+__attribute__((target("avx512f")))
+int32_t sparse24_dot_avx512(const Sparse24& sp, int row, const int8_t* b) {
+    const int8_t* vals = &sp.values[(size_t)row * sp.cols / 2];
+    const uint32_t* idx = &sp.index[(size_t)row * sp.cols / 32];
+    const __m512i shifts = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i group = _mm512_setr_epi32(0, 0, 4, 4, 8, 8, 12, 12, 16, 16, 20, 20, 24, 24, 28, 28);
+    const __m512i three = _mm512_set1_epi32(3);
+    __m512i acc = _mm512_setzero_si512();
+    for (int w = 0; w < sp.cols / 32; w++) {
+        __m512i pos = _mm512_and_epi32(_mm512_srlv_epi32(_mm512_set1_epi32(idx[w]), shifts), three);
+        __m512i k = _mm512_add_epi32(_mm512_add_epi32(pos, group), _mm512_set1_epi32(w * 32));
+        __m512i bv = _mm512_i32gather_epi32(k, (const void*)b, 1);
+        bv = _mm512_srai_epi32(_mm512_slli_epi32(bv, 24), 24);
+        __m512i av = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(vals + w * 16)));
+        acc = _mm512_add_epi32(acc, _mm512_mullo_epi32(av, bv));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+// Times one rows x cols sparse GEMV (one column of B) like bench_kernel_params, in us.
+double bench_sparse24(const Sparse24& sp, Sparse24DotFn dot, const ElemT* b, AccT* c, int threads, int first_core) {
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    double best = 1e300;
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = omp_get_thread_num();
+        int n = omp_get_num_threads();
+        if (first_core + t < num_cores) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(first_core + t, &cpuset);
+            pid_t tid = syscall(SYS_gettid);
+            sched_setaffinity(tid, sizeof(cpu_set_t), &cpuset);
+        }
+        int duty = sp.rows / n;
+        int begin = t * duty;
+        int end = t == n - 1 ? sp.rows : begin + duty;
+        for (int rep = 0; rep <= TUNE_REPS; rep++) {
+            #pragma omp barrier
+            double t0 = omp_get_wtime();
+            for (int i = begin; i < end; i++) c[i] = dot(sp, i, b);
+            #pragma omp barrier
+            if (t == 0 && rep > 0) best = std::min(best, omp_get_wtime() - t0);
+        }
+    }
+    return best * 1e6;
+}
+
+// Dense tile kernel (kp) vs the sparse kernel on the same shape and column of B: time and
+// weight bytes streamed, then the sparse result against the pruned dense matrix (same math,
+// so only rounding differs) and against the unpruned one (the pruning error).
+void compare_sparse24(const Sparse24& sp, Sparse24DotFn dot, const KernelParams& kp, const ElemT* A,
+                      const ElemT* pruned, const ElemT* b, int first_core) {
+    std::vector<AccT> c(sp.rows);
+    double dense_us = bench_kernel_params(kp, A, b, c.data(), sp.rows, sp.cols, first_core, sp.cols);
+    double sparse_us = bench_sparse24(sp, dot, b, c.data(), kp.threads, first_core);
+    double dense_bytes = (double)sp.rows * sp.cols * sizeof(ElemT);
+    double sparse_bytes = sp.values.size() * sizeof(ElemT) + sp.index.size() * sizeof(uint32_t);
+
+    double err_pruned = 0.0, err_dense = 0.0, norm_pruned = 0.0, norm_dense = 0.0, max_diff = 0.0;
+    for (int r = 0; r < sp.rows; r++) {
+        double ref_pruned = 0.0, ref_dense = 0.0;
+        for (int k = 0; k < sp.cols; k++) {
+            ref_pruned += (double)pruned[(size_t)r * sp.cols + k] * b[k];
+            ref_dense += (double)A[(size_t)r * sp.cols + k] * b[k];
+        }
+        double got = (double)c[r];
+        err_pruned += (got - ref_pruned) * (got - ref_pruned);
+        err_dense += (got - ref_dense) * (got - ref_dense);
+        norm_pruned += ref_pruned * ref_pruned;
+        norm_dense += ref_dense * ref_dense;
+        max_diff = std::max(max_diff, std::abs(got - ref_pruned));
+    }
+    printf("2:4 sparse vs dense (%s %dx%d, %d threads):\n", KERNEL_DTYPE, sp.rows, sp.cols, kp.threads);
+    printf("  dense   %10.1f us  %8.2f GB/s of weights  %7.2f GMAC/s  (tile %d, unroll %d, acc %d; --tune for the best)\n",
+           dense_us, dense_bytes / dense_us * 1e-3, (double)sp.rows * sp.cols / dense_us * 1e-3, kp.tile_rows,
+           kp.unroll, kp.accs);
+    printf("  sparse  %10.1f us  %8.2f GB/s of weights  %7.2f effective GMAC/s  (%.2fx, %.0f%% of the bytes)\n",
+           sparse_us, sparse_bytes / sparse_us * 1e-3, (double)sp.rows * sp.cols / sparse_us * 1e-3,
+           dense_us / sparse_us, 100.0 * sparse_bytes / dense_bytes);
+    printf("  accuracy: vs pruned dense rel L2 %.3g (max abs %.3g), vs unpruned dense rel L2 %.3g\n",
+           norm_pruned > 0 ? std::sqrt(err_pruned / norm_pruned) : 0.0, max_diff,
+           norm_dense > 0 ? std::sqrt(err_dense / norm_dense) : 0.0);
 }
 
 int main(int argc, char* argv[]) {
-    // Usage: client <send_overhead (1 or 0)> <ip_address:port>
-    if (argc != 4) {
-        std::cerr << "Usage: client <send_overhead (1 or 0)> <# of heads> <ip_address:port>" << std::endl;
+    // Usage: client <send_overhead (1 or 0)> <ip_address:port> [--key=value ...]
+    if (argc < 4) {
+        std::cerr << "Usage: client <send_overhead (1 or 0)> <# of heads> <ip_address:port>"
+                  << " [--send_schedule=<spec>|@<file>] [--mux=1 --mux_core=<core> --mux_bench=<messages>] [--coro=1 --coro_cores=<list> --coro_bench=<rounds>]"
+                  << " [--metrics=<unix socket path> --metrics_core=<core>]"
+                  << " [--udp=1 --udp_gso=1 --udp_bench=<messages>] [--batch=1 --batch_us=<us> --batch_bytes=<bytes> --cork=1]"
+                  << " [--barrier=omp|spin|futex --spin_limit=<polls>] [--calibrate=1 --calib_mb=<MB>]"
+                  << " [--kernel=loop|generic|specialized --kernel_bench=1] [--sparse=1]"
+                  << " [--partition=equal|sysfs|measured|adaptive --partition_alpha=<0-1>]"
+                  << " [--tune=1|2 --tune_budget_ms=<ms> --tune_cache=<file>]"
+                  << " [--rt=fifo|deadline --rt_prio=<1-99> --rt_send_prio=<1-99> --rt_dl_runtime_us=<us>"
+                  << " --rt_dl_period_us=<us>] [--irq_move=1]"
+                  << " [--freq=1 --freq_period_us=<us> --freq_core=<core> --freq_csv=<file>]" << std::endl;
         return -1;
     }
     
@@ -75,6 +3082,78 @@ int main(int argc, char* argv[]) {
     int server_port = std::stoi(input.substr(colon_pos + 1));
 
     std::cout << "Server IP: " << server_ip << ", Port: " << server_port << std::endl;
+
+    // Send batching: coalesce each socket's messages within a time/byte window (writev).
+    bool batch_sends = std::atoi(get_opt(argc, argv, "batch", "0")) != 0;
+    double batch_us = std::atof(get_opt(argc, argv, "batch_us", "50"));
+    size_t batch_bytes = std::atol(get_opt(argc, argv, "batch_bytes", "16384"));
+    bool batch_cork = std::atoi(get_opt(argc, argv, "cork", "0")) != 0;
+    if (batch_sends) {
+        std::cout << "Send batching: window " << batch_us << " us / " << batch_bytes << " bytes"
+                  << (batch_cork ? ", TCP_CORK" : "") << std::endl;
+    }
+
+    // Multiplexed transport: one connection for the whole rank, drained by a sender on --mux_core.
+    bool mux_sends = std::atoi(get_opt(argc, argv, "mux", "0")) != 0;
+    // UDP transport: every thread's socket is a connected UDP socket and each message one
+    // sequence-numbered datagram; batched sends use sendmmsg, optionally merged by UDP GSO.
+    bool udp = std::atoi(get_opt(argc, argv, "udp", "0")) != 0;
+    bool udp_gso = std::atoi(get_opt(argc, argv, "udp_gso", "0")) != 0;
+    int mux_core = std::atoi(get_opt(argc, argv, "mux_core", "4"));
+    // Coroutine executor: sends run on epoll reactors on --coro_cores and are awaited per iteration.
+    bool coro_sends = std::atoi(get_opt(argc, argv, "coro", "0")) != 0;
+    std::vector<int> coro_cores = parse_core_list(get_opt(argc, argv, "coro_cores", "4"));
+
+    // Send schedule: which threads send at which fractions of their rows, how many bytes, from
+    // which core and through which transport. Empty by default; the trigger variants this file
+    // used to carry in comments are, as specs:
+    //   0@0.25,0.75          thread 0 at 1/4 and 3/4 of its rows
+    //   0@0.25+1@0.5+2@0.75  threads 0-2 at (thread + 1)/4 of their rows
+    //   3@0.5                thread 3 halfway
+    int default_transport = mux_sends ? TRANSPORT_MUX : coro_sends ? TRANSPORT_CORO
+                          : batch_sends ? TRANSPORT_BATCH : TRANSPORT_THREAD;
+    std::string schedule_spec = get_opt(argc, argv, "send_schedule", "");
+    std::vector<SendEntry> send_schedule;
+    if (!parse_send_schedule(schedule_spec, ONE_KB, default_transport, send_schedule)) {
+        std::cerr << "Invalid --send_schedule " << schedule_spec
+                  << " (use threads@fractions[:bytes[:core[:thread|batch|inline|mux|coro]]][+...] or @file)" << std::endl;
+        return -1;
+    }
+    for (const SendEntry& e : send_schedule) {
+        for (const SendEntry& o : send_schedule) {
+            // A batcher or the executor and other senders on one socket would interleave their bytes.
+            bool owns_e = e.transport == TRANSPORT_BATCH || e.transport == TRANSPORT_CORO;
+            bool owns_o = o.transport == TRANSPORT_BATCH || o.transport == TRANSPORT_CORO;
+            if (e.thread == o.thread && e.transport != TRANSPORT_MUX && o.transport != TRANSPORT_MUX &&
+                e.transport != o.transport && (owns_e || owns_o)) {
+                std::cerr << "--send_schedule: thread " << e.thread << " mixes " << transport_names[owns_e ? e.transport : o.transport]
+                          << " with other transports" << std::endl;
+                return -1;
+            }
+        }
+    }
+
+    // End-of-iteration synchronization.
+    std::string barrier_name = get_opt(argc, argv, "barrier", "omp");
+    int barrier_mode = barrier_name == "spin" ? BARRIER_SPIN : barrier_name == "futex" ? BARRIER_FUTEX : BARRIER_OMP;
+    if (barrier_mode == BARRIER_OMP && barrier_name != "omp") {
+        std::cerr << "Unknown --barrier " << barrier_name << " (use omp, spin or futex)" << std::endl;
+        return -1;
+    }
+    int spin_limit = barrier_mode == BARRIER_FUTEX ? std::atoi(get_opt(argc, argv, "spin_limit", "4096")) : -1;
+
+    // Real-time scheduling of the compute (and send) threads, and IRQs moved off compute cores.
+    std::string rt_name = get_opt(argc, argv, "rt", "none");
+    rt_config.policy = rt_name == "fifo" ? RT_FIFO : rt_name == "deadline" ? RT_DEADLINE : RT_NONE;
+    if (rt_config.policy == RT_NONE && rt_name != "none") {
+        std::cerr << "Unknown --rt " << rt_name << " (use none, fifo or deadline)" << std::endl;
+        return -1;
+    }
+    rt_config.prio[RT_COMPUTE] = std::min(std::max(std::atoi(get_opt(argc, argv, "rt_prio", "80")), 1), 99);
+    rt_config.prio[RT_SEND] = std::min(std::max(std::atoi(get_opt(argc, argv, "rt_send_prio", "70")), 1), 99);
+    rt_config.dl_runtime_ns = (uint64_t)(std::atof(get_opt(argc, argv, "rt_dl_runtime_us", "900")) * 1000);
+    rt_config.dl_period_ns = (uint64_t)(std::atof(get_opt(argc, argv, "rt_dl_period_us", "1000")) * 1000);
+    bool irq_move = std::atoi(get_opt(argc, argv, "irq_move", "0")) != 0;
     
     // Print the number of available cores.
     int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
@@ -98,19 +3177,254 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    // Set the number of OpenMP threads to 4.
-    omp_set_num_threads(4);
+    // Matmul kernel: the original loop, or the tile-kernel family with K generic at runtime or
+    // specialized at compile time (falling back to generic for widths without a specialization).
+    // --tune=1 takes the tile parameters from the cache file, or searches them within
+    // --tune_budget_ms and appends the winner on a miss; --tune=2 always re-tunes.
+    int tune = std::atoi(get_opt(argc, argv, "tune", "0"));
+    std::string kernel_name = get_opt(argc, argv, "kernel", tune ? "specialized" : "loop");
+    if (kernel_name != "loop" && kernel_name != "generic" && kernel_name != "specialized") {
+        std::cerr << "Unknown --kernel " << kernel_name << " (use loop, generic or specialized)" << std::endl;
+        return -1;
+    }
+    if (tune && kernel_name == "loop") {
+        std::cerr << "--tune needs --kernel=generic or --kernel=specialized" << std::endl;
+        return -1;
+    }
+    int spec_k = kernel_name == "specialized" ? COLS : 0;
+    KernelParams kp = {5, 4, 1, 0, 4, 0.0};
+    TileKernelFn tile_fn = nullptr, single_fn = nullptr;
+    bool sparse = std::atoi(get_opt(argc, argv, "sparse", "0")) != 0;
+    int8_t* Bt = B;   // B column-major, so each column is a contiguous vector for the tile and sparse kernels.
+    if ((kernel_name != "loop" && B_COLS > 1) || sparse) {
+        Bt = new int8_t[COLS * B_COLS + 64];   // Slack for the sparse kernel's dword gathers.
+        for (int i = 0; i < COLS; i++) {
+            for (int j = 0; j < B_COLS; j++) Bt[(size_t)j * COLS + i] = B[i * B_COLS + j];
+        }
+    }
+    if (kernel_name != "loop") {
+        if (tune) {
+            const char* cache_path = get_opt(argc, argv, "tune_cache", "kernel_tune.cache");
+            std::string key = tune_cache_key(kernel_name, ROWS * num_head, COLS);
+            if (tune != 2 && load_tuned_params(cache_path, key, 4, &kp)) {
+                printf("Tuned kernel from %s: tile %d, unroll %d, acc %d, prefetch %d B, %d threads (%.1f us)\n",
+                       cache_path, kp.tile_rows, kp.unroll, kp.accs, kp.prefetch, kp.threads, kp.us);
+            } else {
+                // One column of B per candidate; every column runs the same kernel.
+                double budget_ms = std::atof(get_opt(argc, argv, "tune_budget_ms", "2000"));
+                kp = autotune_kernel(A, Bt, C, ROWS * num_head, COLS, 0, 4, budget_ms, spec_k);
+                save_tuned_params(cache_path, key, kp);
+            }
+        }
+        tile_fn = find_tile_kernel(kp.tile_rows, kp.unroll, kp.accs, spec_k);
+        single_fn = find_tile_kernel(1, kp.unroll, kp.accs, spec_k);
+        printf("Tile kernel: %s, K=%d%s\n", kernel_name.c_str(), COLS,
+               spec_k && !has_shape_kernels(COLS) ? " (no specialization, generic fallback)" : "");
+        if (std::atoi(get_opt(argc, argv, "kernel_bench", "0"))) {
+            compare_shape_kernels(kp, A, Bt, C, ROWS * num_head, COLS, 0);
+        }
+    }
+    const int prefetch = kp.prefetch / (int)sizeof(int8_t);
+
+    // 2:4 structured sparsity: A is pruned and compressed once, compared against the dense
+    // kernel, and the matmul then runs the sparse kernel.
+    Sparse24 sp;
+    Sparse24DotFn sparse_dot = nullptr;
+    if (sparse) {
+        std::vector<int8_t> pruned((size_t)ROWS * num_head * COLS);
+        if (!sparse24_from_dense(A, ROWS * num_head, COLS, &sp, pruned.data())) {
+            std::cerr << "--sparse needs COLS to be a multiple of 32" << std::endl;
+            return -1;
+        }
+        sparse_dot = __builtin_cpu_supports("avx512f") ? sparse24_dot_avx512 : sparse24_dot_scalar;
+        printf("Sparse kernel: 2:4, %s\n", __builtin_cpu_supports("avx512f") ? "avx512 gather" : "scalar");
+        compare_sparse24(sp, sparse_dot, kp, A, pruned.data(), Bt, 0);
+    }
+
+    // Set the number of OpenMP threads to 4 (or the tuned count).
+    omp_set_num_threads(kp.threads);
     
     // We will run the matrix multiplication 100 times.
     const int NUM_ITER = 100;
-    const int NUM_THREADS = 4;
+    const int NUM_THREADS = 4;   // Per-thread arrays below; kp.threads of them are in use.
+
+    // Roofline calibration on the matmul cores, one core and then all of them.
+    bool calibrate = std::atoi(get_opt(argc, argv, "calibrate", "0")) != 0;
+    size_t llc_bytes = llc_size_bytes();
+    RooflineCalib roofline;
+    if (calibrate) {
+        size_t array_bytes = (size_t)std::atol(get_opt(argc, argv, "calib_mb", "256")) << 20;
+        roofline_probe(1, 0, array_bytes, llc_bytes, 0, &roofline);
+        roofline_probe(NUM_THREADS, 0, array_bytes, llc_bytes, 1, &roofline);
+        print_roofline_calib(roofline, NUM_THREADS, 0);
+    }
     // This array will hold each thread's execution time in one iteration.
     double thread_exec_time[NUM_THREADS] = {0};
     // This variable will sum the maximum time of each iteration.
     double global_time_sum = 0.0;
+    // Per-socket send accounting and the per-socket batchers.
+    SendStats send_stats[NUM_THREADS];
+    SendBatcher batchers[NUM_THREADS];
+    // Live metrics: slot t belongs to compute thread t and its batcher, the last one to the mux.
+    const char* metrics_path = get_opt(argc, argv, "metrics", nullptr);
+    MetricsExporter* metrics = nullptr;
+    MetricsCleanup metrics_cleanup{metrics};
+    if (metrics_path) {
+        std::vector<std::string> labels;
+        for (int t = 0; t < NUM_THREADS; t++) labels.push_back(std::to_string(t));
+        labels.push_back("mux");
+        int metrics_core = std::atoi(get_opt(argc, argv, "metrics_core", "4"));
+        metrics = new MetricsExporter;
+        if (!metrics_start(metrics, metrics_path, labels, std::min(metrics_core, num_cores - 1))) {
+            std::cerr << "Metrics setup failed on " << metrics_path << ": " << strerror(errno) << std::endl;
+            delete metrics;
+            metrics = nullptr;
+            return -1;
+        }
+        for (int t = 0; t < NUM_THREADS; t++) {
+            send_stats[t].metrics = &metrics->seg->slot[t];
+            batchers[t].stats.metrics = &metrics->seg->slot[t];
+        }
+        std::cout << "Metrics on " << metrics_path << ", shared memory /dev/shm" << metrics->shm_name << std::endl;
+    }
+    SpinBarrier* barrier = new SpinBarrier;
+    barrier_init(barrier, kp.threads, spin_limit);
+    // Max time of every iteration, for the frequency correlation.
+    std::vector<double> iter_times(NUM_ITER, 0.0);
+    
+    // Compute (and send) cores of this run, for the IRQ moves and the isolation report.
+    std::vector<int> compute_cores, send_cores;
+    for (int t = 0; t < kp.threads; t++) {
+        if (t + 0 < num_cores) compute_cores.push_back(t + 0);
+    }
+    if (send_overhead) {
+        std::cout << "Send schedule: " << (send_schedule.empty() ? "empty" : schedule_spec) << std::endl;
+    }
+    for (const SendEntry& e : send_schedule) {
+        int core = e.core < 0 ? e.thread + 4 : e.core;
+        if (send_overhead) {
+            printf("  thread %d at %.3f of its rows: %zu bytes, %s%s\n", e.thread, e.at, e.bytes, transport_names[e.transport],
+                   e.transport == TRANSPORT_INLINE || e.transport == TRANSPORT_MUX || e.transport == TRANSPORT_CORO ? "" : (" on core " + std::to_string(core)).c_str());
+            if (e.thread >= kp.threads) printf("  (thread %d does not exist, entry ignored)\n", e.thread);
+        }
+        if (e.thread < kp.threads && e.transport != TRANSPORT_INLINE && e.transport != TRANSPORT_MUX &&
+            e.transport != TRANSPORT_CORO && core < num_cores &&
+            std::find(send_cores.begin(), send_cores.end(), core) == send_cores.end()) {
+            send_cores.push_back(core);
+        }
+    }
+
+    // The rank's multiplexed connection, opened once here when any send goes through it.
+    MuxSender* mux = nullptr;
+    bool use_mux = mux_sends;
+    for (const SendEntry& e : send_schedule) use_mux = use_mux || e.transport == TRANSPORT_MUX;
+    if (udp && use_mux) {
+        std::cerr << "--udp cannot be combined with the mux transport (a TCP byte stream)" << std::endl;
+        return -1;
+    }
+    for (const SendEntry& e : send_schedule) {
+        if (udp && e.bytes > UDP_MAX_PAYLOAD) {
+            std::cerr << "--send_schedule: " << e.bytes << " bytes do not fit in one datagram" << std::endl;
+            return -1;
+        }
+    }
+    int udp_bench = std::atoi(get_opt(argc, argv, "udp_bench", "0"));
+    if (udp_bench > 0) {
+        compare_udp_tcp(server_ip, server_port, kp.threads, udp_bench, ONE_KB, 0, udp_gso);
+    }
+    int mux_bench = std::atoi(get_opt(argc, argv, "mux_bench", "0"));
+    if (mux_bench > 0) {
+        compare_send_layouts(server_ip, server_port, kp.threads, mux_bench, ONE_KB, 0, mux_core);
+    }
+    if (use_mux && send_overhead) {
+        int mux_fd = open_connection(server_ip, server_port);
+        if (mux_fd < 0) {
+            std::cerr << "Mux connection failed: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        mux_core = std::min(mux_core, num_cores - 1);
+        mux = new MuxSender;
+        if (metrics) mux->stats.metrics = &metrics->seg->slot[NUM_THREADS];
+        mux_start(mux, mux_fd, mux_core, 2000);
+        if (std::find(send_cores.begin(), send_cores.end(), mux_core) == send_cores.end()) send_cores.push_back(mux_core);
+        std::cout << "Mux: one connection, sender on core " << mux_core << std::endl;
+    }
+
+    // The coroutine executors, one per --coro_cores entry; compute thread t uses executor t % n.
+    bool use_coro = coro_sends;
+    for (const SendEntry& e : send_schedule) use_coro = use_coro || e.transport == TRANSPORT_CORO;
+    int coro_bench = std::atoi(get_opt(argc, argv, "coro_bench", "0"));
+    if ((use_coro || coro_bench > 0) && (!HAVE_COROUTINES || coro_cores.empty())) {
+        std::cerr << (HAVE_COROUTINES ? "Invalid --coro_cores" : "The coroutine executor needs a -std=c++20 build") << std::endl;
+        return -1;
+    }
+#if HAVE_COROUTINES
+    std::vector<CoroExecutor*> coro_execs;
+    if (coro_bench > 0) {
+        compare_coro_pthread(server_ip, server_port, kp.threads, coro_bench, 3, ONE_KB, 0, coro_cores);
+    }
+    if (use_coro && send_overhead) {
+        for (int core : coro_cores) {
+            core = std::min(core, num_cores - 1);
+            coro_execs.push_back(new CoroExecutor);
+            if (!coro_start(coro_execs.back(), core, 2000)) {
+                std::cerr << "Coroutine executor setup failed: " << strerror(errno) << std::endl;
+                return -1;
+            }
+            if (std::find(send_cores.begin(), send_cores.end(), core) == send_cores.end()) send_cores.push_back(core);
+        }
+        std::cout << "Coroutine executors on cores " << get_opt(argc, argv, "coro_cores", "4") << std::endl;
+    }
+#endif
+    std::atomic<int> connect_failures(0);
+
+    // Row bands of the compute threads: equal, or weighted by sysfs or measured core capacity.
+    const char* partition_opt = get_opt(argc, argv, "partition", nullptr);
+    std::string partition_name = partition_opt ? partition_opt : "equal";
+    int partition_mode = -1;
+    for (int m = 0; m < NUM_PARTITIONS; m++) {
+        if (partition_name == partition_names[m]) partition_mode = m;
+    }
+    if (partition_mode < 0) {
+        std::cerr << "Unknown --partition " << partition_name << " (use equal, sysfs, measured or adaptive)" << std::endl;
+        return -1;
+    }
+    std::vector<int> thread_cores;
+    for (int t = 0; t < kp.threads; t++) thread_cores.push_back(t < num_cores ? t : -1);
+    RowPartition partition;
+    partition_init(&partition, partition_mode, thread_cores, ROWS * num_head, sparse_dot ? 1 : tile_fn ? kp.tile_rows : 5,
+                   std::atof(get_opt(argc, argv, "partition_alpha", "0.3")));
+    if (partition_mode != PARTITION_EQUAL) {
+        std::cout << "Row partition: " << partition_name;
+        for (int t = 0; t < partition.threads; t++) std::cout << (t ? ", " : " ") << partition.bounds[t + 1] - partition.bounds[t];
+        std::cout << " rows" << std::endl;
+    }
+    std::vector<IrqMove> irq_moves;
+    IrqRestore irq_restore{irq_moves};
+    int irq_refused = 0, irq_untouched = 0;
+    if (irq_move) {
+        move_irqs_off(compute_cores, num_cores, irq_moves, &irq_refused, &irq_untouched);
+        if (!irq_moves.empty()) {
+            irq_signal_moves.store(&irq_moves);
+            signal(SIGINT, restore_irqs_on_signal);
+            signal(SIGTERM, restore_irqs_on_signal);
+        }
+    }
+    
+    // Frequency telemetry of the compute and send cores, sampled by a thread on --freq_core.
+    FreqSampler* freq = nullptr;
+    if (std::atoi(get_opt(argc, argv, "freq", "0"))) {
+        std::vector<int> monitored = compute_cores;
+        monitored.insert(monitored.end(), send_cores.begin(), send_cores.end());
+        freq = new FreqSampler;
+        freq_open(freq, monitored, NUM_ITER);
+        freq->period_us = std::max(std::atof(get_opt(argc, argv, "freq_period_us", "1000")), 50.0);
+        freq->core_id = std::min(std::atoi(get_opt(argc, argv, "freq_core", "4")), num_cores - 1);
+        pthread_create(&freq->thread, nullptr, freq_main, (void*) freq);
+    }
     
     // Start the OpenMP parallel region.
-    #pragma omp parallel shared(global_time_sum, thread_exec_time, A, B, C, send_overhead, server_ip, server_port)
+    #pragma omp parallel shared(global_time_sum, thread_exec_time, A, B, C, send_overhead, server_ip, server_port, send_stats, batchers, barrier)
     {
         int thread_id = omp_get_thread_num();
         int num_threads = omp_get_num_threads();  // should be 4
@@ -127,77 +3441,156 @@ int main(int argc, char* argv[]) {
                           << thread_id << ": " << strerror(errno) << std::endl;
             }
         }
+        rt_apply(RT_COMPUTE);
         
-        // Create a TCP socket once per thread and connect to the server.
-        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd < 0) {
-            std::cerr << "Thread " << thread_id << " error creating socket: " 
-                      << strerror(errno) << std::endl;
-            #pragma omp cancel parallel
-        }
-        struct sockaddr_in serv_addr;
-        memset(&serv_addr, 0, sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(server_port);
-        if (inet_pton(AF_INET, server_ip.c_str(), &serv_addr.sin_addr) <= 0) {
-            std::cerr << "Thread " << thread_id << " invalid address: " << server_ip << std::endl;
-            close(sockfd);
-            #pragma omp cancel parallel
-        }
-        if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 && thread_id == 3) {
-            std::cerr << "Thread " << thread_id << " connection failed: " 
-                      << strerror(errno) << std::endl;
-            close(sockfd);
-            #pragma omp cancel parallel
-        }
         
-        // Each thread works on a subset of rows.
-        int duty = ROWS * num_head / num_threads;
-        int start = thread_id * duty;
-        int end = (thread_id + 1) * duty;
+        // Each thread works on a band of rows (equal unless --partition weights them).
+        int start = partition.bounds[thread_id];
+        int end = partition.bounds[thread_id + 1];
+
+        // This thread's sends, with trigger rows precomputed; by default from core thread + 4.
+        std::vector<SendEntry> my_sends = thread_send_schedule(send_schedule, thread_id, start, end, thread_id + 4);
+        bool use_batcher = false;
+        bool own_socket = !mux;
+        for (const SendEntry& e : my_sends) {
+            use_batcher = use_batcher || e.transport == TRANSPORT_BATCH;
+            own_socket = own_socket || e.transport != TRANSPORT_MUX;
+        }
+
+        // Connect to the server, unless every send of this thread goes through the mux. All
+        // threads must be connected before any of them starts.
+        int sockfd = -1;
+        if (own_socket) {
+            sockfd = udp ? open_udp(server_ip, server_port) : open_connection(server_ip, server_port);
+            if (sockfd < 0) {
+                std::cerr << "Thread " << thread_id << " connection failed: " << strerror(errno) << std::endl;
+                connect_failures.fetch_add(1);
+            }
+        }
+        #pragma omp barrier
+        bool connected = connect_failures.load() == 0;
+        if (use_batcher && connected) {
+            batcher_start(&batchers[thread_id], sockfd, thread_id + 4, batch_cork, batch_bytes, batch_us, udp_gso);
+        }
+        SendBatcher* batcher = use_batcher ? &batchers[thread_id] : nullptr;
+        uint32_t udp_seq = 0;
+#if HAVE_COROUTINES
+        CoroExecutor* coro_ex = coro_execs.empty() ? nullptr : coro_execs[thread_id % coro_execs.size()];
+        std::vector<CommOp*> comm_ops;   // Coroutine sends of this iteration, awaited at its end.
+#endif
+
+        // Cost of one barrier episode with all threads arriving back to back, for the
+        // OpenMP barrier and for the selected SpinBarrier mode.
+        if (barrier_mode != BARRIER_OMP) {
+            const int rounds = 2000;
+            #pragma omp barrier
+            double calib_start = omp_get_wtime();
+            for (int r = 0; r < rounds; r++) {
+                #pragma omp barrier
+            }
+            double omp_cost = omp_get_wtime() - calib_start;
+            double dummy = 0.0, out;
+            calib_start = omp_get_wtime();
+            for (int r = 0; r < rounds; r++) {
+                barrier_arrive_max(barrier, thread_id, &dummy, 1, &out);
+            }
+            double spin_cost = omp_get_wtime() - calib_start;
+            if (thread_id == 0) {
+                std::cout << "Barrier episode: omp " << omp_cost / rounds * 1e9 << " ns, " << barrier_name
+                          << " " << spin_cost / rounds * 1e9 << " ns" << std::endl;
+            }
+            // Only the iterations below count towards the wake-up latency report.
+            barrier->slots[thread_id].waits = 0;
+            barrier->slots[thread_id].wake_ns_sum = 0.0;
+            barrier->slots[thread_id].wake_ns_max = 0.0;
+        }
         
         // Repeat the matrix multiplication NUM_ITER times.
-        for (int iter = 0; iter < NUM_ITER; iter++) {
-            bool async_send_started = false;
+        for (int iter = 0; connected && iter < NUM_ITER; iter++) {
+            if (start != partition.bounds[thread_id] || end != partition.bounds[thread_id + 1]) {
+                // Re-partitioned after the last iteration: move the band and its send triggers.
+                start = partition.bounds[thread_id];
+                end = partition.bounds[thread_id + 1];
+                my_sends = thread_send_schedule(send_schedule, thread_id, start, end, thread_id + 4);
+            }
+            bool send_pending = false;   // A send thread of this iteration is still to be joined.
             pthread_t send_thread;
+            size_t next_send = 0;
+            int next_row = send_overhead && !my_sends.empty() ? my_sends[0].row : INT_MAX;
             double start_time = omp_get_wtime();
+
+            // Fires every scheduled send whose trigger row is below upto, then moves next_row
+            // on to the following entry. Send threads on the socket chain onto each other, so
+            // only the newest one is joined.
+            auto fire_sends = [&](int upto) {
+                for (; next_send < my_sends.size() && my_sends[next_send].row < upto; next_send++) {
+                    const SendEntry& e = my_sends[next_send];
+                    // A message of e.bytes filled with 'A'.
+                    char* message = (char*)malloc(e.bytes);
+                    memset(message, 'A', e.bytes);
+                    size_t msg_len = e.bytes;
+                    if (udp) message = udp_datagram(message, &msg_len, thread_id, udp_seq++);
+                    if (e.transport == TRANSPORT_INLINE) {
+                        if (send_pending) {
+                            pthread_join(send_thread, nullptr);
+                            send_pending = false;
+                        }
+                        send_inline(sockfd, message, msg_len, &send_stats[thread_id]);
+                    } else if (e.transport == TRANSPORT_MUX && mux) {
+                        mux_submit(mux, thread_id, message, msg_len);
+#if HAVE_COROUTINES
+                    } else if (e.transport == TRANSPORT_CORO && coro_ex) {
+                        comm_ops.push_back(coro_send(coro_ex, sockfd, message, msg_len, &send_stats[thread_id]));
+#endif
+                    } else {
+                        bool started = launch_send(sockfd, e.core, message, msg_len, e.transport == TRANSPORT_BATCH ? batcher : nullptr,
+                                                   &send_stats[thread_id], &send_thread, send_pending ? &send_thread : nullptr);
+                        send_pending = send_pending || started;
+                    }
+                }
+                next_row = next_send < my_sends.size() ? my_sends[next_send].row : INT_MAX;
+            };
             
-            // Tiled matrix multiplication with a tile size of 5 x 1.
-            const int TILE_ROWS = 5;
-            const int TILE_COLS = 1; // Because B_COLS is 1.
-            for (int ii = start; ii < end; ii += TILE_ROWS) {
-                int i_max = std::min(ii + TILE_ROWS, end);
-                for (int jj = 0; jj < B_COLS; jj += TILE_COLS) {
-                    int j_max = std::min(jj + TILE_COLS, B_COLS);
-                    for (int i = ii; i < i_max; i++) {
-                        // Launch async send at a specific row.
-                        // !async_send_started && send_overhead && (thread_id == 0) && (i == start + (duty / 4 * (thread_id + 1)) || i == start + (duty / 4 * (thread_id + 3)))
-                        // !async_send_started && send_overhead && (thread_id != 3) && (i == start + (duty / 4 * (thread_id + 1)))
-                        // !async_send_started && send_overhead && (thread_id == 3) && (i == start + (duty / 2))
-                        // if (!async_send_started && send_overhead && (thread_id != 3) && (i == start + (duty / 4 * (thread_id + 1)))) {
-                        //     // async_send_started = true;
-                        //     printf("here!\n");
-                        //     // Create a 1KB message filled with 'A'.
-                        //     char* message = (char*)malloc(ONE_KB);
-                        //     memset(message, 'A', ONE_KB);
-                            
-                        //     // Set parameters for the async send thread.
-                        //     AsyncSendParams* send_params = new AsyncSendParams;
-                        //     send_params->sockfd = sockfd;
-                        //     send_params->core_id = thread_id + 4; // Use cores 0-3 for async send.
-                        //     send_params->message = message;
-                        //     send_params->msg_len = ONE_KB;
-                            
-                        //     int rc = pthread_create(&send_thread, nullptr, async_send, (void*) send_params);
-                        //     // You can check rc for errors if needed.
-                        // }
-                        for (int j = jj; j < j_max; j++) {
-                            int32_t sum = 0;
-                            for (int k = 0; k < COLS; k++) {
-                                sum += static_cast<int32_t>(A[i * COLS + k]) *
-                                       static_cast<int32_t>(B[k * B_COLS + j]);
+            if (sparse_dot) {
+                // 2:4 sparse kernel, one row at a time.
+                for (int i = start; i < end; i++) {
+                    if (i == next_row) fire_sends(i + 1);
+                    for (int j = 0; j < B_COLS; j++) C[i * B_COLS + j] = sparse_dot(sp, i, Bt + (size_t)j * COLS);
+                }
+            } else if (tile_fn) {
+                // Tuned tile kernel, one contiguous column of B at a time; sends fire before the
+                // tile holding their trigger row.
+                for (int ii = start; ii < end; ii += kp.tile_rows) {
+                    int n = std::min(kp.tile_rows, end - ii);
+                    if (next_row < ii + n) fire_sends(ii + n);
+                    for (int j = 0; j < B_COLS; j++) {
+                        const int8_t* b = Bt + (size_t)j * COLS;
+                        if (n == kp.tile_rows) {
+                            tile_fn(A, b, C + j, B_COLS, ii, COLS, prefetch);
+                        } else {
+                            for (int i = ii; i < ii + n; i++) single_fn(A, b, C + j, B_COLS, i, COLS, prefetch);
+                        }
+                    }
+                }
+            } else {
+                // Tiled matrix multiplication with a tile size of 5 x 1.
+                const int TILE_ROWS = 5;
+                const int TILE_COLS = 1; // Because B_COLS is 1.
+                for (int ii = start; ii < end; ii += TILE_ROWS) {
+                    int i_max = std::min(ii + TILE_ROWS, end);
+                    for (int jj = 0; jj < B_COLS; jj += TILE_COLS) {
+                        int j_max = std::min(jj + TILE_COLS, B_COLS);
+                        for (int i = ii; i < i_max; i++) {
+                            // Launch the sends scheduled at this row.
+                            if (i == next_row) fire_sends(i + 1);
+                            for (int j = jj; j < j_max; j++) {
+                                int32_t sum = 0;
+                                for (int k = 0; k < COLS; k++) {
+                                    sum += static_cast<int32_t>(A[i * COLS + k]) *
+                                           static_cast<int32_t>(B[k * B_COLS + j]);
+                                }
+                                C[i * B_COLS + j] = sum;
                             }
-                            C[i * B_COLS + j] = sum;
                         }
                     }
                 }
@@ -206,39 +3599,181 @@ int main(int argc, char* argv[]) {
             // Measure this thread's execution time.
             double thread_time = omp_get_wtime() - start_time;
             thread_exec_time[thread_id] = thread_time;
+            if (metrics) metric_iteration(&metrics->seg->slot[thread_id], thread_time * 1e6);
 
-            // If an async send was started, wait for it to finish.
-            if (async_send_started) {
+            // If a send thread was started, wait for it to finish (batched sends are not joined),
+            // and await the coroutine sends.
+            if (send_pending) {
                 pthread_join(send_thread, nullptr);
             }
+#if HAVE_COROUTINES
+            for (CommOp* op : comm_ops) comm_wait(op);
+            comm_ops.clear();
+#endif
             
-            // Wait for all threads.
-            #pragma omp barrier
-            
-            // Only one thread (thread 0) finds the maximum time.
-            #pragma omp single
-            {
-                double iter_max = thread_exec_time[0];
-                for (int t = 1; t < num_threads; t++) {
-                    if (thread_exec_time[t] > iter_max)
-                        iter_max = thread_exec_time[t];
+            if (barrier_mode == BARRIER_OMP) {
+                // Wait for all threads.
+                #pragma omp barrier
+
+                // Only one thread (thread 0) finds the maximum time.
+                #pragma omp single
+                {
+                    double iter_max = thread_exec_time[0];
+                    for (int t = 1; t < num_threads; t++) {
+                        if (thread_exec_time[t] > iter_max)
+                            iter_max = thread_exec_time[t];
+                    }
+                    iter_times[iter] = iter_max;
+                    partition_update(&partition, iter, thread_exec_time);
+                    if (iter >= 10) partition.samples++;
+                    if (freq) freq->iter.store(iter + 1, std::memory_order_relaxed);
+                    if (iter >= 10)
+                        global_time_sum += iter_max;
+                    std::cout << "Iteration " << iter << " max time: "
+                              << iter_max * 1000000 << " us" << std::endl;
+                }
+                #pragma omp barrier
+                if (iter >= 10) {
+                    partition.busy[thread_id] += thread_time;
+                    partition.idle[thread_id] += iter_times[iter] - thread_time;
+                }
+            } else {
+                // A single barrier episode; the last thread to arrive computes the maximum.
+                double iter_max;
+                barrier_arrive_max(barrier, thread_id, &thread_time, 1, &iter_max);
+                if (thread_id == 0) {
+                    iter_times[iter] = iter_max;
+                    if (freq) freq->iter.store(iter + 1, std::memory_order_relaxed);
+                    if (iter >= 10)
+                        global_time_sum += iter_max;
+                    std::cout << "Iteration " << iter << " max time: "
+                              << iter_max * 1000000 << " us" << std::endl;
+                }
+                if (iter >= 10) {
+                    partition.busy[thread_id] += thread_time;
+                    partition.idle[thread_id] += iter_max - thread_time;
+                }
+                if (partition.mode == PARTITION_ADAPTIVE || (partition.mode == PARTITION_MEASURED && iter < 10)) {
+                    // Every thread_exec_time is in; hold the others until the new bands are out.
+                    if (thread_id == 0) {
+                        partition_update(&partition, iter, thread_exec_time);
+                        if (iter >= 10) partition.samples++;
+                    }
+                    #pragma omp barrier
+                } else if (thread_id == 0 && iter >= 10) {
+                    partition.samples++;
                 }
-                if (iter >= 10)
-                    global_time_sum += iter_max;
-                std::cout << "Iteration " << iter << " max time: " 
-                          << iter_max * 1000000 << " us" << std::endl;
             }
-            #pragma omp barrier
         }
         
+        // Drain the batcher before closing its socket.
+        if (use_batcher && connected) {
+            batcher_stop(&batchers[thread_id]);
+        }
+
         // Close the socket after all iterations.
-        close(sockfd);
+        if (sockfd >= 0) close(sockfd);
     } // End of parallel region.
+
+    if (connect_failures.load() > 0) {
+        std::cerr << connect_failures.load() << " thread(s) could not connect to " << server_ip << ":"
+                  << server_port << ", no iterations were run" << std::endl;
+        return -1;
+    }
+    if (mux) {
+        mux_stop(mux);
+        close(mux->sockfd);
+    }
+#if HAVE_COROUTINES
+    for (CoroExecutor* ex : coro_execs) coro_stop(ex);
+#endif
+    if (metrics) {
+        metrics_stop(metrics);
+        std::cout << "Metrics: " << metrics->scrapes << " scrapes served" << std::endl;
+        delete metrics;
+        metrics = nullptr;
+    }
     
     // Calculate and print the average matrix multiplication time.
     double avg_time = global_time_sum / (NUM_ITER - 10);
     std::cout << "Average matrix multiplication time over " << NUM_ITER 
               << " iterations: " << avg_time * 1000000 << " us" << std::endl;
+    if (partition_opt) {
+        print_partition_report(&partition, thread_cores, avg_time);
+    }
+    if (calibrate) {
+        double rows = (double)ROWS * num_head;
+        print_roofline_result("int8 matmul", 2.0 * rows * COLS * B_COLS,
+                              rows * COLS + (double)COLS * B_COLS + sizeof(int32_t) * rows * B_COLS,
+                              avg_time, roofline.int8_gops[1], roofline, llc_bytes);
+    }
+
+    // Release-to-wakeup latency of the threads that waited in the SpinBarrier.
+    if (barrier_mode != BARRIER_OMP) {
+        unsigned long waits = 0;
+        double wake_sum = 0.0, wake_max = 0.0;
+        for (int t = 0; t < NUM_THREADS; t++) {
+            waits += barrier->slots[t].waits;
+            wake_sum += barrier->slots[t].wake_ns_sum;
+            wake_max = std::max(wake_max, barrier->slots[t].wake_ns_max);
+        }
+        std::cout << "Barrier (" << barrier_name << ") wake-up latency: avg "
+                  << (waits ? wake_sum / waits : 0.0) << " ns, max " << wake_max << " ns over "
+                  << waits << " waits" << std::endl;
+    }
+    delete barrier;
+
+    // Send-path cost: syscalls, CPU time on the send cores and message latency.
+    if (send_overhead && !send_schedule.empty()) {
+        SendStats total;
+        for (int t = 0; t <= 2 * NUM_THREADS; t++) {
+            if (t == 2 * NUM_THREADS && !mux) break;
+            SendStats& st = t < NUM_THREADS ? send_stats[t] : t < 2 * NUM_THREADS ? batchers[t - NUM_THREADS].stats : mux->stats;
+            total.messages += st.messages;
+            total.syscalls += st.syscalls;
+            total.bytes += st.bytes;
+            total.failed += st.failed;
+            total.cpu_time += st.cpu_time;
+            total.latency_us.insert(total.latency_us.end(), st.latency_us.begin(), st.latency_us.end());
+        }
+#if HAVE_COROUTINES
+        // Executor CPU, including the time it spent spinning for work.
+        for (CoroExecutor* ex : coro_execs) {
+            total.cpu_time += ex->cpu_time;
+            printf("Coroutine executor on core %d: %lu resumes, %lu epoll_waits, %.1f us CPU\n", ex->core_id,
+                   ex->resumes, ex->epoll_waits, ex->cpu_time * 1e6);
+            delete ex;
+        }
+        coro_execs.clear();
+#endif
+        double msgs = total.messages ? (double)total.messages : 1.0;
+        std::cout << "Send path (" << schedule_spec << "): "
+                  << total.messages << " messages, " << total.bytes << " bytes, "
+                  << total.syscalls << " syscalls (" << total.syscalls / msgs << " per message)" << std::endl;
+        std::cout << "Send core CPU time: " << total.cpu_time * 1000000 << " us total, "
+                  << total.cpu_time * 1000000 / msgs << " us per message" << std::endl;
+        std::cout << "Send latency: p50 " << percentile(total.latency_us, 50) << " us, p99 "
+                  << percentile(total.latency_us, 99) << " us, max "
+                  << percentile(total.latency_us, 100) << " us" << std::endl;
+        if (total.failed) {
+            std::cout << "Send failures: " << total.failed << " messages dropped (no send thread could be started)"
+                      << std::endl;
+        }
+    }
+    
+    if (irq_move) {
+        restore_irqs(irq_moves);
+        irq_restore.done = true;
+    }
+    if (freq) {
+        freq->stop.store(true);
+        pthread_join(freq->thread, nullptr);
+        freq_report(freq, iter_times, compute_cores, get_opt(argc, argv, "freq_csv", nullptr));
+        delete freq;
+    }
+    if (rt_config.policy != RT_NONE || irq_move) {
+        print_rt_report(compute_cores, send_cores, irq_move, (int)irq_moves.size(), irq_refused, irq_untouched);
+    }
     
     // Print the first 10 results of matrix C (from the last iteration).
     std::cout << "First 10 results of matrix C:" << std::endl;
@@ -250,7 +3785,9 @@ int main(int argc, char* argv[]) {
     // Clean up allocated memory.
     delete[] A;
     delete[] B;
+    if (Bt != B) delete[] Bt;
     delete[] C;
+    delete mux;
     
     return 0;
 }
@@ -8,7 +8,21 @@
 #include <vector>
 #include <algorithm> // For std::max
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <thread>
+#include <string>
+#include <fcntl.h>
+#include <sched.h>    // For sched_setaffinity
+#include <csignal>
+#include <cerrno>
+#include <cstdint>
+#include <cmath>
+#include <unordered_map>
+#include <immintrin.h>  // For F16C conversions
+#include <netinet/udp.h>  // For UDP_GRO
+#include <arpa/inet.h>
+#include <sys/mman.h>  // For the hugepage sink ring
+#include "wire_format.h"  // Codecs, frame and mux headers shared with the clients
 
 unsigned long timeUs() {
     struct timeval te; 
@@ -38,16 +52,814 @@ ssize_t read_all(int sock, char* buffer, size_t size, int e) {
     return total_read;
 }
 
+// Returns the value of an optional "--key=value" flag, or def if it is absent.
+const char* get_opt(int argc, char* argv[], const char* key, const char* def) {
+    size_t key_len = strlen(key);
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0 && strncmp(argv[i] + 2, key, key_len) == 0 &&
+            argv[i][2 + key_len] == '=') {
+            return argv[i] + 3 + key_len;
+        }
+    }
+    return def;
+}
+
+// Parses a core list such as "4,5,6,7" or "4-7" (ranges and commas may be mixed).
+std::vector<int> parse_core_list(const std::string& list) {
+    std::vector<int> cores;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t dash = item.find('-');
+        if (!item.empty()) {
+            int first = atoi(item.c_str());
+            int last = dash == std::string::npos ? first : atoi(item.c_str() + dash + 1);
+            for (int c = first; c <= last; c++) {
+                cores.push_back(c);
+            }
+        }
+        if (comma == std::string::npos) break;
+        pos = comma + 1;
+    }
+    return cores;
+}
+
+// Largest frame payload (and decoded size) accepted; anything above is a malformed stream, so
+// a corrupt header cannot make the server buffer or allocate without bound.
+#define MAX_FRAME_BYTES (64u << 20)
+
+__attribute__((target("f16c,avx")))
+void decode_fp16_f16c(const uint16_t* src, float* dst, uint32_t count) {
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+    }
+    for (; i < count; i++) dst[i] = fp16_to_fp32_scalar(src[i]);
+}
+
+// Decodes a frame payload into dst (count floats). Returns false if the sizes do not match.
+bool decode_payload(const FrameHeader& hdr, const char* payload, float* dst) {
+    static const bool has_f16c = __builtin_cpu_supports("f16c");
+    uint32_t count = hdr.count;
+    switch (hdr.codec) {
+        case CODEC_FP32:
+            if (hdr.bytes != count * sizeof(float)) return false;
+            memcpy(dst, payload, hdr.bytes);
+            return true;
+        case CODEC_FP16:
+            if (hdr.bytes != count * sizeof(uint16_t)) return false;
+            if (has_f16c) {
+                decode_fp16_f16c((const uint16_t*)payload, dst, count);
+            } else {
+                for (uint32_t i = 0; i < count; i++) dst[i] = fp16_to_fp32_scalar(((const uint16_t*)payload)[i]);
+            }
+            return true;
+        case CODEC_BF16:
+            if (hdr.bytes != count * sizeof(uint16_t)) return false;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t x = (uint32_t)((const uint16_t*)payload)[i] << 16;
+                memcpy(&dst[i], &x, sizeof(float));
+            }
+            return true;
+        case CODEC_INT8: {
+            uint32_t blocks = (count + CODEC_INT8_BLOCK - 1) / CODEC_INT8_BLOCK;
+            if (hdr.bytes != blocks * sizeof(float) + count) return false;
+            for (uint32_t b = 0; b < count; b += CODEC_INT8_BLOCK) {
+                uint32_t n = std::min((uint32_t)CODEC_INT8_BLOCK, count - b);
+                float scale;
+                memcpy(&scale, payload, sizeof(float));
+                const int8_t* q = (const int8_t*)(payload + sizeof(float));
+                for (uint32_t i = 0; i < n; i++) dst[b + i] = q[i] * scale;
+                payload += sizeof(float) + n;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Set from the SIGINT/SIGTERM handler; every shard polls it between epoll waits.
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int) {
+    stop_requested = 1;
+}
+
+// Per-shard counters. Each shard owns its instance exclusively while running; main only
+// reads it after joining the shard thread, so no synchronization is needed.
+struct alignas(64) ShardStats {
+    int core = -1;
+    unsigned long connections = 0;   // Connections accepted by this shard.
+    unsigned long closed = 0;        // Connections closed by the peer.
+    unsigned long bytes = 0;         // Payload bytes received.
+    unsigned long reads = 0;         // Successful read() calls.
+    unsigned long elapsed_us = 0;    // Time from the first accept to the last byte received.
+    bool failed = false;
+    // Frame decoding (--decode=1), per codec.
+    unsigned long frames[NUM_CODECS] = {0};
+    unsigned long raw_bytes[NUM_CODECS] = {0};    // Decoded fp32 bytes.
+    unsigned long wire_bytes[NUM_CODECS] = {0};   // Header + payload bytes.
+    double decode_us[NUM_CODECS] = {0};
+    unsigned long bad_frames = 0;
+    // Multiplexed connections, demultiplexed per channel.
+    unsigned long mux_connections = 0;
+    unsigned long channel_messages[MAX_MUX_CHANNELS] = {0};
+    unsigned long channel_bytes[MAX_MUX_CHANNELS] = {0};      // Payload bytes.
+    unsigned long channel_gaps[MAX_MUX_CHANNELS] = {0};       // Out-of-sequence messages.
+    // UDP (--udp=1): datagrams, sequence-number loss accounting and receive cost.
+    unsigned long udp_datagrams = 0;
+    unsigned long udp_bytes = 0;
+    unsigned long udp_lost = 0;      // Sequence numbers skipped and not (yet) seen late.
+    unsigned long udp_late = 0;      // Datagrams arriving after a higher sequence number.
+    unsigned long udp_syscalls = 0;  // recvmmsg calls.
+    unsigned long udp_bad = 0;       // Datagrams without a valid MuxHeader.
+    double udp_cpu_us = 0.0;         // Shard CPU time spent on the UDP socket.
+    double tcp_cpu_us = 0.0;         // Shard CPU time spent on TCP connections.
+    unsigned long tcp_messages = 0;  // Mux messages and decoded frames on TCP; reads on unframed connections.
+    // Sink (--sink=<mode>): whole-shard CPU time and payload check results.
+    double cpu_us = 0.0;
+    unsigned long payload_errors = 0;  // Plain-payload bytes that were not 'A' (--check=1).
+};
+
+double thread_cpu_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+// Per-connection reassembly buffer for framed payloads: bytes [head, data.size()) are pending.
+struct FrameBuffer {
+    std::vector<char> data;
+    size_t head = 0;
+};
+
+// Decodes every complete frame in fb, adding them to *messages if set. Returns false on a
+// malformed stream.
+bool decode_frames(FrameBuffer& fb, std::vector<float>& scratch, ShardStats* stats, unsigned long* messages) {
+    while (fb.data.size() - fb.head >= sizeof(FrameHeader)) {
+        FrameHeader hdr;
+        memcpy(&hdr, fb.data.data() + fb.head, sizeof(hdr));
+        if (hdr.magic != FRAME_MAGIC || hdr.codec >= NUM_CODECS || hdr.bytes > MAX_FRAME_BYTES ||
+            hdr.count > MAX_FRAME_BYTES / sizeof(float)) {
+            stats->bad_frames++;
+            return false;
+        }
+        if (fb.data.size() - fb.head < sizeof(FrameHeader) + hdr.bytes) break;
+        if (scratch.size() < hdr.count) scratch.resize(hdr.count);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        bool ok = decode_payload(hdr, fb.data.data() + fb.head + sizeof(FrameHeader), scratch.data());
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (!ok) {
+            stats->bad_frames++;
+            return false;
+        }
+        stats->frames[hdr.codec]++;
+        stats->raw_bytes[hdr.codec] += hdr.count * sizeof(float);
+        stats->wire_bytes[hdr.codec] += sizeof(FrameHeader) + hdr.bytes;
+        stats->decode_us[hdr.codec] += (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) * 1e-3;
+        fb.head += sizeof(FrameHeader) + hdr.bytes;
+        if (messages) (*messages)++;
+    }
+    // Compact once the consumed prefix dominates the buffer.
+    if (fb.head > 0 && fb.head * 2 >= fb.data.size()) {
+        fb.data.erase(fb.data.begin(), fb.data.begin() + fb.head);
+        fb.head = 0;
+    }
+    return true;
+}
+
+// Per-connection receive state. A connection is classified by its first four bytes: a mux
+// stream is reassembled and split by channel, anything else is plain (framed or not).
+enum ConnKind {
+    CONN_UNKNOWN = 0,
+    CONN_PLAIN = 1,
+    CONN_MUX = 2,
+};
+
+struct ConnState {
+    int kind = CONN_UNKNOWN;
+    FrameBuffer in;                                      // Mux stream, or plain frames with --decode=1.
+    std::unordered_map<int, FrameBuffer> channels;       // Per-channel payload frames (--decode=1).
+    uint32_t next_seq[MAX_MUX_CHANNELS] = {0};
+};
+
+// Splits every complete mux message in cs.in by channel, checking each channel's sequence
+// numbers; with decode, the channel's payload bytes are decoded as frames. Returns false on a
+// malformed stream.
+bool demux_frames(ConnState& cs, bool decode, std::vector<float>& scratch, ShardStats* stats) {
+    FrameBuffer& fb = cs.in;
+    while (fb.data.size() - fb.head >= sizeof(MuxHeader)) {
+        MuxHeader hdr;
+        memcpy(&hdr, fb.data.data() + fb.head, sizeof(hdr));
+        // A mux message carries one client message, no larger than a whole frame.
+        if (hdr.magic != MUX_MAGIC || hdr.channel >= MAX_MUX_CHANNELS ||
+            hdr.bytes > sizeof(FrameHeader) + MAX_FRAME_BYTES) {
+            stats->bad_frames++;
+            return false;
+        }
+        if (fb.data.size() - fb.head < sizeof(MuxHeader) + hdr.bytes) break;
+        const char* payload = fb.data.data() + fb.head + sizeof(MuxHeader);
+        stats->channel_messages[hdr.channel]++;
+        stats->channel_bytes[hdr.channel] += hdr.bytes;
+        stats->tcp_messages++;
+        if (hdr.seq != cs.next_seq[hdr.channel]) stats->channel_gaps[hdr.channel]++;
+        cs.next_seq[hdr.channel] = hdr.seq + 1;
+        if (decode) {
+            FrameBuffer& ch = cs.channels[hdr.channel];
+            ch.data.insert(ch.data.end(), payload, payload + hdr.bytes);
+            if (!decode_frames(ch, scratch, stats, nullptr)) return false;
+        }
+        fb.head += sizeof(MuxHeader) + hdr.bytes;
+    }
+    if (fb.head > 0 && fb.head * 2 >= fb.data.size()) {
+        fb.data.erase(fb.data.begin(), fb.data.begin() + fb.head);
+        fb.head = 0;
+    }
+    return true;
+}
+
+// UDP receive side: every datagram is a MuxHeader plus payload. Batches of UDP_BATCH buffers
+// are filled per recvmmsg; with GRO one buffer may hold several datagrams of the size given
+// in the UDP_GRO control message.
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#define UDP_BATCH 32
+#define UDP_BUFFER 65536
+
+struct UdpReceiver {
+    std::vector<char> buffers;                          // UDP_BATCH * UDP_BUFFER bytes.
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char ctrl[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    std::unordered_map<uint64_t, uint32_t> next_seq;    // Per (source address, port, channel).
+};
+
+// Sequence accounting for one datagram: a jump counts the skipped numbers as lost, a lower
+// number is a late (reordered) datagram that was counted as lost before.
+void udp_account(UdpReceiver& r, const struct sockaddr_in& from, const char* data, size_t len, ShardStats* stats) {
+    MuxHeader hdr;
+    if (len < sizeof(hdr)) {
+        stats->udp_bad++;
+        return;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.magic != MUX_MAGIC || hdr.channel >= MAX_MUX_CHANNELS || sizeof(hdr) + hdr.bytes != len) {
+        stats->udp_bad++;
+        return;
+    }
+    stats->udp_datagrams++;
+    stats->udp_bytes += len;
+    stats->channel_messages[hdr.channel]++;
+    stats->channel_bytes[hdr.channel] += hdr.bytes;
+    uint64_t key = ((uint64_t)ntohl(from.sin_addr.s_addr) << 24) | ((uint64_t)ntohs(from.sin_port) << 8) | hdr.channel;
+    auto it = r.next_seq.find(key);
+    uint32_t expected = it == r.next_seq.end() ? 0 : it->second;
+    if (hdr.seq >= expected) {
+        stats->udp_lost += hdr.seq - expected;
+        r.next_seq[key] = hdr.seq + 1;
+    } else {
+        stats->udp_late++;
+        if (stats->udp_lost > 0) stats->udp_lost--;
+    }
+}
+
+// Reads every datagram queued on the socket.
+void drain_udp(int fd, UdpReceiver& r, ShardStats* stats) {
+    while (true) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            r.iov[i] = {&r.buffers[(size_t)i * UDP_BUFFER], UDP_BUFFER};
+            memset(&r.msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            r.msgs[i].msg_hdr.msg_iov = &r.iov[i];
+            r.msgs[i].msg_hdr.msg_iovlen = 1;
+            r.msgs[i].msg_hdr.msg_name = &r.addrs[i];
+            r.msgs[i].msg_hdr.msg_namelen = sizeof(r.addrs[i]);
+            r.msgs[i].msg_hdr.msg_control = r.ctrl[i];
+            r.msgs[i].msg_hdr.msg_controllen = sizeof(r.ctrl[i]);
+        }
+        int n = recvmmsg(fd, r.msgs, UDP_BATCH, MSG_DONTWAIT, nullptr);
+        if (n <= 0) break;
+        stats->udp_syscalls++;
+        for (int i = 0; i < n; i++) {
+            size_t len = r.msgs[i].msg_len;
+            size_t segment = len;
+            for (struct cmsghdr* cm = CMSG_FIRSTHDR(&r.msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&r.msgs[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    int gso_size;
+                    memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                    if (gso_size > 0) segment = gso_size;
+                }
+            }
+            const char* data = (const char*)r.iov[i].iov_base;
+            for (size_t off = 0; off < len; off += segment) {
+                udp_account(r, r.addrs[i], data + off, std::min(segment, len - off), stats);
+            }
+        }
+        if (n < UDP_BATCH) break;
+    }
+}
+
+// Non-blocking UDP socket on the shard's port (SO_REUSEPORT spreads senders across shards).
+int open_shard_udp(int port, bool gro) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int opt = 1;
+    int rcvbuf = 8 << 20;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (gro && setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt))) {
+        fprintf(stderr, "UDP_GRO not supported: %s\n", strerror(errno));
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// How a shard drains plain (unframed, undecoded) connections. The payload is never inspected
+// unless --check=1, so the copy into a user buffer can be skipped: MSG_TRUNC discards in the
+// kernel, splice moves pages into a pipe drained to /dev/null, and the ring reuses one
+// hugepage-backed region so the copy at least stays in the same TLB entry and cache lines.
+enum SinkMode {
+    SINK_READ = 0,
+    SINK_TRUNC = 1,
+    SINK_SPLICE = 2,
+    SINK_RING = 3,
+    NUM_SINKS
+};
+const char* sink_names[NUM_SINKS] = {"read", "trunc", "splice", "ring"};
+
+#define SINK_CHUNK (1 << 20)     // Bytes asked for per trunc/splice call.
+#define SINK_RING_BYTES (2 << 20)  // One 2 MB hugepage.
+
+struct Sink {
+    int mode = SINK_READ;
+    bool check = false;
+    int pipefd[2] = {-1, -1};        // SINK_SPLICE: [0] read end, [1] write end.
+    int devnull = -1;
+    char* ring = nullptr;            // SINK_RING
+    size_t ring_pos = 0;
+    bool hugepage = false;
+};
+
+// Counts bytes of a plain payload that differ from the 'A' fill the clients send.
+unsigned long check_payload(const char* data, size_t len) {
+    const uint64_t pattern = 0x4141414141414141ULL;
+    unsigned long errors = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word != pattern) {
+            for (int b = 0; b < 8; b++) errors += data[i + b] != 'A';
+        }
+    }
+    for (; i < len; i++) errors += data[i] != 'A';
+    return errors;
+}
+
+// Sets up the per-shard resources of a sink mode. Returns false if the mode is unavailable.
+bool sink_open(Sink& sink, int mode, bool check) {
+    sink.mode = mode;
+    sink.check = check;
+    if (mode == SINK_SPLICE) {
+        if (pipe2(sink.pipefd, O_NONBLOCK) < 0) return false;
+        fcntl(sink.pipefd[1], F_SETPIPE_SZ, SINK_CHUNK);
+        sink.devnull = open("/dev/null", O_WRONLY);
+        return sink.devnull >= 0;
+    }
+    if (mode == SINK_RING) {
+        void* p = mmap(nullptr, SINK_RING_BYTES, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        sink.hugepage = p != MAP_FAILED;
+        if (!sink.hugepage) {
+            // No reserved hugepages: fall back to a transparent hugepage request.
+            p = mmap(nullptr, SINK_RING_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) return false;
+            madvise(p, SINK_RING_BYTES, MADV_HUGEPAGE);
+        }
+        sink.ring = (char*)p;
+        memset(sink.ring, 0, SINK_RING_BYTES);  // Fault the pages in before traffic starts.
+    }
+    return true;
+}
+
+void sink_close(Sink& sink) {
+    if (sink.pipefd[0] >= 0) close(sink.pipefd[0]);
+    if (sink.pipefd[1] >= 0) close(sink.pipefd[1]);
+    if (sink.devnull >= 0) close(sink.devnull);
+    if (sink.ring) munmap(sink.ring, SINK_RING_BYTES);
+}
+
+// One drain step on a plain connection, with read() semantics: bytes consumed, 0 on EOF,
+// -1 with errno set (EAGAIN when the socket is empty).
+ssize_t sink_recv(Sink& sink, int fd, char* buffer, size_t buffer_size, ShardStats* stats) {
+    switch (sink.mode) {
+    case SINK_TRUNC:
+        // TCP discards up to len bytes without copying when the buffer is NULL and MSG_TRUNC is set.
+        return recv(fd, nullptr, SINK_CHUNK, MSG_TRUNC | MSG_DONTWAIT);
+    case SINK_SPLICE: {
+        ssize_t n = splice(fd, nullptr, sink.pipefd[1], nullptr, SINK_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        for (ssize_t left = n; left > 0;) {
+            ssize_t m = splice(sink.pipefd[0], nullptr, sink.devnull, nullptr, left, SPLICE_F_MOVE);
+            if (m <= 0) {
+                if (m < 0 && errno == EINTR) continue;
+                return -1;
+            }
+            left -= m;
+        }
+        return n;
+    }
+    case SINK_RING: {
+        if (sink.ring_pos == SINK_RING_BYTES) sink.ring_pos = 0;
+        char* dst = sink.ring + sink.ring_pos;
+        ssize_t n = recv(fd, dst, SINK_RING_BYTES - sink.ring_pos, MSG_DONTWAIT);
+        if (n > 0) {
+            sink.ring_pos += n;
+            if (sink.check) stats->payload_errors += check_payload(dst, n);
+        }
+        return n;
+    }
+    default: {
+        ssize_t n = read(fd, buffer, buffer_size);
+        if (n > 0 && sink.check) stats->payload_errors += check_payload(buffer, n);
+        return n;
+    }
+    }
+}
+
+// Creates a non-blocking listener bound with SO_REUSEPORT so that every shard has its own
+// accept queue and the kernel spreads incoming connections across them.
+int open_shard_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int opt = 1;
+    // SO_REUSEADDR and SO_REUSEPORT are separate options, not flags, so set them one by one.
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        close(fd);
+        return -1;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 128) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// One shard: pinned to its core, owns its listener, its epoll instance, its receive buffer
+// and every connection it accepts, end to end.
+void run_shard(int core, int port, int duration_s, bool decode, bool udp, bool gro, int sink_mode, bool check,
+               ShardStats* stats) {
+    stats->core = core;
+    double cpu_begin = thread_cpu_us();
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core, &cpuset);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) {
+        fprintf(stderr, "shard %d: sched_setaffinity failed: %s\n", core, strerror(errno));
+    }
+
+    int listen_fd = open_shard_listener(port);
+    int epoll_fd = epoll_create1(0);
+    if (listen_fd < 0 || epoll_fd < 0) {
+        fprintf(stderr, "shard %d: listener setup failed: %s\n", core, strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+        stats->failed = true;
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    int udp_fd = -1;
+    UdpReceiver* udp_rx = nullptr;
+    if (udp) {
+        udp_fd = open_shard_udp(port, gro);
+        if (udp_fd < 0) {
+            fprintf(stderr, "shard %d: UDP socket setup failed: %s\n", core, strerror(errno));
+        } else {
+            udp_rx = new UdpReceiver;
+            udp_rx->buffers.resize((size_t)UDP_BATCH * UDP_BUFFER);
+            ev.data.fd = udp_fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &ev);
+        }
+    }
+
+    Sink sink;
+    if (!sink_open(sink, sink_mode, check)) {
+        fprintf(stderr, "shard %d: %s sink unavailable (%s), using read\n", core, sink_names[sink_mode], strerror(errno));
+        sink_close(sink);
+        sink = Sink();
+        sink.check = check;
+    } else if (sink_mode == SINK_RING && !sink.hugepage) {
+        fprintf(stderr, "shard %d: no reserved hugepages, ring uses transparent hugepages\n", core);
+    }
+
+    const int buffer_size = 256 * 1024;
+    char* buffer = new char[buffer_size];
+    const int max_events = 64;
+    struct epoll_event events[max_events];
+    std::unordered_map<int, ConnState> conns;
+    std::vector<float> decoded;
+
+    unsigned long start_us = timeUs();
+    unsigned long first_accept_us = 0;
+    unsigned long last_data_us = 0;
+    unsigned long report_us = start_us;
+    unsigned long report_bytes = 0;
+    int open_connections = 0;
+
+    while (!stop_requested) {
+        unsigned long now = timeUs();
+        if (duration_s > 0 && now - start_us >= (unsigned long)duration_s * 1000000UL) break;
+
+        // Per-core progress once a second while traffic is flowing.
+        if (now - report_us >= 1000000UL) {
+            if (stats->bytes != report_bytes) {
+                double mbps = (stats->bytes - report_bytes) / (double)(now - report_us);
+                printf("shard core %d: %d open connections, %.1f MB/s\n", core, open_connections, mbps);
+            }
+            report_us = now;
+            report_bytes = stats->bytes;
+        }
+
+        int n = epoll_wait(epoll_fd, events, max_events, 100);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "shard %d: epoll_wait failed: %s\n", core, strerror(errno));
+            stats->failed = true;
+            break;
+        }
+        for (int e = 0; e < n; e++) {
+            int fd = events[e].data.fd;
+            if (fd == udp_fd) {
+                double cpu_start = thread_cpu_us();
+                drain_udp(udp_fd, *udp_rx, stats);
+                stats->udp_cpu_us += thread_cpu_us() - cpu_start;
+                last_data_us = timeUs();
+                if (first_accept_us == 0) first_accept_us = last_data_us;
+                continue;
+            }
+            if (fd == listen_fd) {
+                int conn;
+                while ((conn = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    if (first_accept_us == 0) first_accept_us = timeUs();
+                    struct epoll_event cev;
+                    cev.events = EPOLLIN;
+                    cev.data.fd = conn;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn, &cev);
+                    stats->connections++;
+                    open_connections++;
+                }
+                continue;
+            }
+            // Drain the connection until it would block.
+            double cpu_start = udp ? thread_cpu_us() : 0.0;
+            while (true) {
+                // Connections are classified from their first bytes; plain ones then go to the sink.
+                auto known = conns.find(fd);
+                bool to_sink = !decode && known != conns.end() && known->second.kind == CONN_PLAIN;
+                ssize_t bytes_read = to_sink ? sink_recv(sink, fd, buffer, buffer_size, stats)
+                                             : read(fd, buffer, buffer_size);
+                if (bytes_read < 0 && to_sink && sink.mode != SINK_READ && errno != EAGAIN && errno != EINTR) {
+                    // The kernel refused the zero-copy path for this socket: fall back for the shard.
+                    fprintf(stderr, "shard %d: %s sink failed (%s), using read\n", core, sink_names[sink.mode], strerror(errno));
+                    sink_close(sink);
+                    sink = Sink();
+                    sink.check = check;
+                    continue;
+                }
+                if (bytes_read > 0) {
+                    stats->bytes += bytes_read;
+                    stats->reads++;
+                    last_data_us = timeUs();
+                    if (to_sink) {
+                        stats->tcp_messages++;
+                        continue;
+                    }
+                    ConnState& cs = conns[fd];
+                    if (cs.kind != CONN_PLAIN || decode) {
+                        cs.in.data.insert(cs.in.data.end(), buffer, buffer + bytes_read);
+                        if (cs.kind == CONN_UNKNOWN && cs.in.data.size() >= sizeof(uint32_t)) {
+                            uint32_t magic;
+                            memcpy(&magic, cs.in.data.data(), sizeof(magic));
+                            cs.kind = magic == MUX_MAGIC ? CONN_MUX : CONN_PLAIN;
+                            if (cs.kind == CONN_MUX) stats->mux_connections++;
+                            if (cs.kind == CONN_PLAIN && !decode) {
+                                stats->tcp_messages++;
+                                if (check) stats->payload_errors += check_payload(cs.in.data.data(), cs.in.data.size());
+                                cs.in.data.clear();
+                            }
+                        }
+                        bool ok = cs.kind == CONN_MUX ? demux_frames(cs, decode, decoded, stats)
+                                : cs.kind == CONN_PLAIN && decode ? decode_frames(cs.in, decoded, stats, &stats->tcp_messages) : true;
+                        if (!ok) {
+                            fprintf(stderr, "shard %d: malformed frame stream, dropping connection\n", core);
+                            bytes_read = 0;
+                        }
+                    }
+                    if (bytes_read > 0) continue;
+                }
+                if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (bytes_read < 0 && errno == EINTR) continue;
+                // Peer closed (or the connection failed): the shard forgets it.
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+                conns.erase(fd);
+                stats->closed++;
+                open_connections--;
+                break;
+            }
+            if (udp) stats->tcp_cpu_us += thread_cpu_us() - cpu_start;
+        }
+    }
+
+    stats->elapsed_us = last_data_us > first_accept_us ? last_data_us - first_accept_us : 0;
+    stats->cpu_us = thread_cpu_us() - cpu_begin;
+    sink_close(sink);
+    delete[] buffer;
+    close(epoll_fd);
+    close(listen_fd);
+    if (udp_fd >= 0) close(udp_fd);
+    delete udp_rx;
+}
+
+// Thread-per-core mode: one SO_REUSEPORT listener per core, no state shared between shards.
+int run_sharded_server(int port, const std::vector<int>& cores, int duration_s, bool decode, bool udp, bool gro,
+                       int sink_mode, bool check) {
+    signal(SIGINT, handle_stop_signal);
+    signal(SIGTERM, handle_stop_signal);
+
+    std::vector<ShardStats> stats(cores.size());
+    std::vector<std::thread> shards;
+    for (size_t s = 0; s < cores.size(); s++) {
+        shards.emplace_back(run_shard, cores[s], port, duration_s, decode, udp, gro, sink_mode, check,
+                            &stats[s]);
+    }
+    std::cout << "Sharded server on port " << port << " with " << cores.size()
+              << " shards" << (udp ? (gro ? ", UDP with GRO" : ", UDP") : "") << ", " << sink_names[sink_mode]
+              << " sink" << (check ? " with payload check" : "") << " (Ctrl-C to stop)" << std::endl;
+    for (std::thread& t : shards) {
+        t.join();
+    }
+
+    unsigned long total_bytes = 0;
+    unsigned long total_connections = 0;
+    unsigned long max_elapsed_us = 0;
+    printf("==============================================================\n");
+    // GB/s/core: bytes per second of shard CPU time, i.e. what one core could ingest if it did nothing else.
+    unsigned long payload_errors = 0;
+    double total_cpu_us = 0.0;
+    printf("%6s %8s %14s %10s %12s %10s %10s %10s\n", "core", "conns", "bytes", "MB/s", "reads", "avg read",
+           "cpu ms", "GB/s/core");
+    for (const ShardStats& st : stats) {
+        double mbps = st.elapsed_us ? st.bytes / (double)st.elapsed_us : 0.0;
+        double avg_read = st.reads ? st.bytes / (double)st.reads : 0.0;
+        double gbps_core = st.cpu_us > 0 ? st.bytes / st.cpu_us / 1e3 : 0.0;
+        printf("%6d %8lu %14lu %10.1f %12lu %10.0f %10.1f %10.2f%s\n", st.core, st.connections, st.bytes, mbps,
+               st.reads, avg_read, st.cpu_us / 1e3, gbps_core, st.failed ? "  (failed)" : "");
+        payload_errors += st.payload_errors;
+        total_cpu_us += st.cpu_us;
+        total_bytes += st.bytes;
+        total_connections += st.connections;
+        max_elapsed_us = std::max(max_elapsed_us, st.elapsed_us);
+    }
+    printf("total: %lu connections, %lu bytes, %.1f MB/s aggregate, %.2f GB/s per busy core (%s sink)\n",
+           total_connections, total_bytes, max_elapsed_us ? total_bytes / (double)max_elapsed_us : 0.0,
+           total_cpu_us > 0 ? total_bytes / total_cpu_us / 1e3 : 0.0, sink_names[sink_mode]);
+    if (check) printf("payload check: %lu bad bytes\n", payload_errors);
+
+    if (decode) {
+        printf("%6s %10s %14s %14s %10s %14s\n", "codec", "frames", "raw bytes", "wire bytes", "wire %", "decode us/frm");
+        unsigned long bad_frames = 0;
+        for (const ShardStats& st : stats) bad_frames += st.bad_frames;
+        for (int c = 0; c < NUM_CODECS; c++) {
+            unsigned long frames = 0, raw = 0, wire = 0;
+            double decode_us = 0.0;
+            for (const ShardStats& st : stats) {
+                frames += st.frames[c];
+                raw += st.raw_bytes[c];
+                wire += st.wire_bytes[c];
+                decode_us += st.decode_us[c];
+            }
+            if (frames == 0) continue;
+            printf("%6s %10lu %14lu %14lu %9.1f%% %14.2f\n", codec_names[c], frames, raw, wire,
+                   100.0 * wire / raw, decode_us / frames);
+        }
+        if (bad_frames) printf("malformed streams: %lu\n", bad_frames);
+    }
+
+    // Multiplexed connections: what arrived on each channel.
+    unsigned long mux_connections = 0;
+    for (const ShardStats& st : stats) mux_connections += st.mux_connections;
+    if (mux_connections) {
+        printf("mux: %lu connections\n", mux_connections);
+        printf("%8s %12s %14s %10s %8s\n", "channel", "messages", "bytes", "avg msg", "gaps");
+        for (int c = 0; c < MAX_MUX_CHANNELS; c++) {
+            unsigned long messages = 0, bytes = 0, gaps = 0;
+            for (const ShardStats& st : stats) {
+                messages += st.channel_messages[c];
+                bytes += st.channel_bytes[c];
+                gaps += st.channel_gaps[c];
+            }
+            if (messages == 0) continue;
+            printf("%8d %12lu %14lu %10.0f %8lu\n", c, messages, bytes, bytes / (double)messages, gaps);
+        }
+    }
+
+    // UDP: loss from sequence numbers and receive CPU per datagram next to TCP per message.
+    if (udp) {
+        unsigned long datagrams = 0, bytes = 0, lost = 0, late = 0, syscalls = 0, bad = 0, tcp_messages = 0;
+        double udp_cpu = 0.0, tcp_cpu = 0.0;
+        for (const ShardStats& st : stats) {
+            datagrams += st.udp_datagrams;
+            bytes += st.udp_bytes;
+            lost += st.udp_lost;
+            late += st.udp_late;
+            syscalls += st.udp_syscalls;
+            bad += st.udp_bad;
+            udp_cpu += st.udp_cpu_us;
+            tcp_cpu += st.tcp_cpu_us;
+            tcp_messages += st.tcp_messages;
+        }
+        printf("udp: %lu datagrams, %lu bytes, %lu lost (%.3f%%), %lu late, %lu malformed\n", datagrams, bytes,
+               lost, datagrams + lost ? 100.0 * lost / (datagrams + lost) : 0.0, late, bad);
+        printf("%6s %12s %14s %14s\n", "recv", "messages", "syscalls/msg", "CPU us/msg");
+        if (datagrams) {
+            printf("%6s %12lu %14.3f %14.3f\n", "udp", datagrams, syscalls / (double)datagrams, udp_cpu / datagrams);
+        }
+        if (tcp_messages) {
+            printf("%6s %12lu %14s %14.3f\n", "tcp", tcp_messages, "-", tcp_cpu / tcp_messages);
+        }
+    }
+    return 0;
+}
+
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: server <port>" << std::endl;
+    if (argc < 2) {
+        std::cerr << "Usage: server <port> [--shards=<core list>] [--duration=<seconds>] [--decode=1] [--udp=1 --gro=1] [--sink=read|trunc|splice|ring --check=1] [--clients=<n>]" << std::endl;
         return -1;
     }
 
+    // Thread-per-core mode: --shards=4-7 starts one SO_REUSEPORT listener per listed core.
+    const char* shard_list = get_opt(argc, argv, "shards", nullptr);
+    if (shard_list) {
+        std::vector<int> cores = parse_core_list(shard_list);
+        if (cores.empty()) {
+            std::cerr << "Invalid --shards core list: " << shard_list << std::endl;
+            return -1;
+        }
+        // Sink mode for plain connections (see SinkMode); --check=1 verifies the payload, so it needs a copy.
+        const char* sink_name = get_opt(argc, argv, "sink", "read");
+        int sink_mode = -1;
+        for (int m = 0; m < NUM_SINKS; m++) {
+            if (strcmp(sink_name, sink_names[m]) == 0) sink_mode = m;
+        }
+        bool check = atoi(get_opt(argc, argv, "check", "0")) != 0;
+        if (sink_mode < 0) {
+            std::cerr << "Invalid --sink: " << sink_name << " (read, trunc, splice or ring)" << std::endl;
+            return -1;
+        }
+        if (check && (sink_mode == SINK_TRUNC || sink_mode == SINK_SPLICE)) {
+            std::cerr << "--check=1 needs the payload in memory: use --sink=read or --sink=ring" << std::endl;
+            return -1;
+        }
+        return run_sharded_server(atoi(argv[1]), cores, atoi(get_opt(argc, argv, "duration", "0")),
+                                  atoi(get_opt(argc, argv, "decode", "0")) != 0,
+                                  atoi(get_opt(argc, argv, "udp", "0")) != 0,
+                                  atoi(get_opt(argc, argv, "gro", "0")) != 0, sink_mode, check);
+    }
+
     // Extract command-line arguments
     int data_size = 1 * 8192 * 100; // Convert the data size argument to an integer
-    int num_clients = 1;      // Number of clients to wait for
+    int num_clients = std::max(atoi(get_opt(argc, argv, "clients", "1")), 1);   // Number of clients to wait for
     int iterations = 1;
     int port = atoi(argv[1]);             // Convert the port argument to an integer
 
@@ -0,0 +1,69 @@
+// Wire format shared by the clients and server.cpp: the payload codecs and the frame header in
+// front of every encoded payload (--codec / --decode=1), the mux header of multiplexed
+// connections (--mux=1, and every UDP datagram), and the scalar fp16 conversion both sides use.
+#ifndef SEND_OVERHEAD_WIRE_FORMAT_H
+#define SEND_OVERHEAD_WIRE_FORMAT_H
+
+#include <cstdint>
+#include <cstring>
+
+// Payload codecs for sending C instead of filler bytes (client --codec=...).
+enum PayloadCodec : uint16_t {
+    CODEC_FP32 = 0,   // Raw fp32, 4 bytes per element.
+    CODEC_FP16 = 1,   // IEEE half, 2 bytes per element.
+    CODEC_BF16 = 2,   // bfloat16, 2 bytes per element.
+    CODEC_INT8 = 3,   // Symmetric int8 with one fp32 scale per CODEC_INT8_BLOCK elements.
+    NUM_CODECS = 4,
+};
+#define CODEC_INT8_BLOCK 64
+#define FRAME_MAGIC 0x48564f53u   // "SOVH"
+
+static const char* const codec_names[NUM_CODECS] = {"fp32", "fp16", "bf16", "int8"};
+
+// Header in front of every encoded payload.
+struct FrameHeader {
+    uint32_t magic;     // FRAME_MAGIC.
+    uint16_t codec;     // PayloadCodec.
+    uint16_t channel;   // Sending thread.
+    uint32_t seq;       // Per-channel sequence number.
+    uint32_t count;     // Number of fp32 elements encoded.
+    uint32_t bytes;     // Payload bytes following the header.
+};
+
+// Multiplexed connections: one connection per rank, each message behind a MuxHeader naming its
+// channel (the client's compute thread); the server demultiplexes by channel.
+#define MUX_MAGIC 0x584d4f53u   // "SOMX"
+#define MAX_MUX_CHANNELS 64
+
+struct MuxHeader {
+    uint32_t magic;
+    uint16_t channel;   // Compute thread that produced the message.
+    uint16_t flags;     // Reserved, 0.
+    uint32_t seq;       // Per-channel sequence number.
+    uint32_t bytes;     // Payload bytes following the header.
+};
+
+// Scalar IEEE fp16 -> fp32, for CPUs without F16C and for the tails of the vector loops.
+inline float fp16_to_fp32_scalar(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if (exp == 0x1f) {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {
+        x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        x = sign;
+    } else {
+        // Subnormal half: renormalize.
+        int e = -1;
+        do { e++; mant <<= 1; } while ((mant & 0x400) == 0);
+        x = sign | ((127 - 15 - e) << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+#endif